@@ -0,0 +1,633 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+
+#include <algorithm>
+#include <tuple>
+#include <vector>
+
+#include "Frame.hh"
+#include "FrameColumns.hh"
+
+
+namespace BIVCodec
+{
+  /// Pointer-free alternative to ImageBSP, decoder side only.
+  /// Node (layer, path) lives at values[(1<<layer)|path], existence is kept
+  /// in a separate bitmap. Storage grows with the deepest applied layer, so
+  /// a full 24 layer tree needs 2^26 slots.
+  class FlatImageBSP
+  {
+    private: float width = 1.0f;
+    private: float ratio = 1.0f;
+    private: ColorSpace color_mode;
+
+    private: const float empty_color = -1.f;
+
+    // nodes with layer < depth are addressable
+    private: int depth = 0;
+
+    private: std::vector<float> values;
+    // Haar codes of detail coded nodes, ImageNode::no_detail elsewhere
+    private: std::vector<int8_t> details;
+    private: std::vector<uint64_t> presence;
+    // changed since the last renderDirty, same layout as presence
+    private: std::vector<uint64_t> dirty;
+    // repairDirty scratch, nodes to be repaired
+    private: std::vector<uint64_t> repair_set;
+
+    private: bool redraw_all = true;
+
+    // frames of this layer and deeper don't build nodes
+    private: int layer_cutoff = FrameLocation::max_layer;
+
+    public: int frames = 0;
+
+    public: explicit FlatImageBSP(const ColorSpace _mode):
+        color_mode(_mode)
+    {
+      this->reserveLayers(1);
+      this->setPresent(1);
+      this->setDirty(1);
+    }
+
+    public: static inline uint64_t nodeIndex(const int _layer, const uint64_t _path) noexcept
+    {
+      return (uint64_t(1)<<_layer)|_path;
+    }
+
+    public: static inline int nodeLayer(const uint64_t _index) noexcept
+    {
+      assert(_index != 0);
+      return 63-__builtin_clzll(_index);
+    }
+
+    // path bit of layer L selects the child, so children of (L,p) are
+    // (L+1,p) and (L+1,p|1<<L)
+    public: static inline uint64_t leftChild(const uint64_t _index) noexcept
+    {
+      return _index+(uint64_t(1)<<nodeLayer(_index));
+    }
+
+    public: static inline uint64_t rightChild(const uint64_t _index) noexcept
+    {
+      return _index+(uint64_t(2)<<nodeLayer(_index));
+    }
+
+    public: static inline uint64_t parentNode(const uint64_t _index) noexcept
+    {
+      const int layer = nodeLayer(_index);
+      assert(layer > 0);
+
+      return (_index^(uint64_t(1)<<layer))|(uint64_t(1)<<(layer-1));
+    }
+
+    public: inline bool isPresent(const uint64_t _index) const noexcept
+    {
+      return (_index < this->values.size()) &&
+             (this->presence[_index>>6] & (uint64_t(1)<<(_index&63)));
+    }
+
+    public: inline float getValue(const uint64_t _index) const noexcept
+    {
+      assert(this->isPresent(_index));
+      return this->values[_index];
+    }
+
+    private: inline void setPresent(const uint64_t _index) noexcept
+    {
+      this->presence[_index>>6] |= uint64_t(1)<<(_index&63);
+    }
+
+    private: inline bool isDirty(const uint64_t _index) const noexcept
+    {
+      return this->dirty[_index>>6] & (uint64_t(1)<<(_index&63));
+    }
+
+    private: inline void setDirty(const uint64_t _index) noexcept
+    {
+      this->dirty[_index>>6] |= uint64_t(1)<<(_index&63);
+    }
+
+    /// Marks _node and its ancestors dirty, up to the first one that is
+    /// already, the ancestors of a dirty node are all dirty
+    private: inline void markPath(uint64_t _node) noexcept
+    {
+      for (; !this->isDirty(_node); _node = parentNode(_node))
+      {
+        this->setDirty(_node);
+
+        if (_node == 1)
+          break;
+      }
+    }
+
+    public: void reserveLayers(const int _depth)
+    {
+      if (_depth <= this->depth)
+        return;
+
+      const size_t size = size_t(1)<<_depth;
+
+      this->values.resize(size, this->empty_color);
+      this->details.resize(size, static_cast<int8_t>(ImageNode::no_detail));
+      this->presence.resize(std::max<size_t>(size/64, 1), 0);
+      this->dirty.resize(this->presence.size(), 0);
+      this->depth = _depth;
+    }
+
+    /// Frames of layer _layers and deeper are dropped on arrival, storage
+    /// never grows past the cutoff. See ImageBSP::displayLayers.
+    public: void setLayerCutoff(const int _layers) noexcept
+    {
+      assert(_layers > 0);
+
+      this->layer_cutoff = std::min(_layers, FrameLocation::max_layer);
+    }
+
+    public: void setDisplaySize(const int _width, const int _height) noexcept
+    {
+      this->setLayerCutoff(ImageBSP::displayLayers(_width, _height));
+    }
+
+    /// THREAD UNSAFE
+    public: void applyFrameData(const FrameImageData &_modifier)
+    {
+      // a damaged layer would ask for up to 2^57 slots
+      if (_modifier.location.layer > FrameLocation::wire_layers)
+        return;
+
+      this->applyNode(_modifier.location.layer, _modifier.location.index(), _modifier.value_l, _modifier.value_r);
+    }
+
+    /// THREAD UNSAFE, same as ImageBSP::applyFrameData
+    public: void applyFrameData(const FrameDetailData &_modifier)
+    {
+      if ((_modifier.location.layer >= this->layer_cutoff) ||
+          (_modifier.location.layer > FrameLocation::wire_layers))
+        return;
+
+      const int layer = _modifier.location.layer;
+      const uint64_t node = _modifier.location.index();
+
+      this->reserveLayers(layer+2);
+      this->details[node] = _modifier.detail;
+
+      this->setPresent(leftChild(node));
+      this->setPresent(rightChild(node));
+
+      for (uint64_t id = node; !this->isPresent(id); id = parentNode(id))
+        this->setPresent(id);
+
+      this->markPath(node);
+
+      uint64_t top = node;
+      while ((top > 1) && (this->values[top] == this->empty_color))
+        top = parentNode(top);
+
+      if (this->values[top] != this->empty_color)
+        this->propagateDetail(top);
+
+      this->frames++;
+    }
+
+    public: void applyFrameData(const FrameSyncData &_modifier) noexcept
+    {
+      if ((this->width != _modifier.width) || (this->ratio != _modifier.ratio))
+        this->invalidate();
+
+      this->width = _modifier.width;
+      this->ratio = _modifier.ratio;
+      this->color_mode = _modifier.color_format;
+
+      if ((_modifier.mean >= 0) && (this->values[1] != _modifier.mean))
+      {
+        this->values[1] = _modifier.mean;
+        this->setDirty(1);
+
+        this->propagateDetail(1);
+      }
+    }
+
+    public: void applyFrameChain(const std::vector<Frame> &_frames)
+    {
+      for (const auto &frame : _frames)
+      {
+        if (frame.isImage())
+          applyFrameData(frame.image);
+        else if (frame.isDetail())
+          applyFrameData(frame.detail);
+        else
+          applyFrameData(frame.sync);
+      }
+    }
+
+    /// Same as applying records [_begin, _end) one by one, straight from the columns
+    public: void applyFrameColumns(const FrameColumns &_columns, const size_t _begin, const size_t _end)
+    {
+      assert(_end <= _columns.size());
+
+      size_t next_sync = std::lower_bound(_columns.sync_index.begin(), _columns.sync_index.end(), _begin)-
+                         _columns.sync_index.begin();
+
+      for (size_t i = _begin; i < _end; ++i)
+      {
+        // records off a damaged link are dropped before anything is indexed
+        if ((_columns.isImage(i) || _columns.isDetail(i)) && (_columns.layers[i] > FrameLocation::wire_layers))
+          continue;
+
+        if (_columns.isImage(i))
+        {
+          const int layer = _columns.layers[i];
+          const uint64_t path = _columns.paths[i] & ((uint64_t(1)<<layer)-1);
+
+          this->applyNode(layer, nodeIndex(layer, path), _columns.values_l[i], _columns.values_r[i]);
+        }
+        else if (_columns.isDetail(i))
+        {
+          FrameDetailData detail;
+          detail.channel = _columns.channels[i];
+          detail.detail = static_cast<FrameDetailData::Code>(_columns.values_l[i]);
+          detail.location.defuse(_columns.paths[i], _columns.layers[i]);
+
+          this->applyFrameData(detail);
+        }
+        else
+        {
+          assert(_columns.sync_index[next_sync] == i);
+          applyFrameData(_columns.sync[next_sync++]);
+        }
+      }
+    }
+
+    public: void applyFrameColumns(const FrameColumns &_columns)
+    {
+      this->applyFrameColumns(_columns, 0, _columns.size());
+    }
+
+    private: void applyNode(const int _layer, const uint64_t _node, const float _value_l, const float _value_r)
+    {
+      if (_layer >= this->layer_cutoff)
+      {
+        this->foldDeepFrame(_layer, _node, (_value_l+_value_r)/2);
+        return;
+      }
+
+      this->reserveLayers(_layer+2);
+
+      const uint64_t left = leftChild(_node);
+      const uint64_t right = rightChild(_node);
+
+      this->values[left] = _value_l;
+      this->values[right] = _value_r;
+      this->values[_node] = (_value_l+_value_r)/2;
+
+      this->setPresent(left);
+      this->setPresent(right);
+
+      // ancestors get created once, so this is O(1) amortized over a chain
+      for (uint64_t id = _node; !this->isPresent(id); id = parentNode(id))
+        this->setPresent(id);
+
+      this->setDirty(left);
+      this->setDirty(right);
+      this->markPath(_node);
+
+      this->frames++;
+    }
+
+    private: inline float childValue(const uint64_t _node, const int _side) const noexcept
+    {
+      const float value = this->values[_node];
+
+      if ((value == this->empty_color) || (this->details[_node] == ImageNode::no_detail))
+        return value;
+
+      return FrameDetailData::childValue(value, this->details[_node], _side);
+    }
+
+    /// Same as ImageBSP::propagateDetail, the ancestors of _node must be
+    /// dirty already
+    private: void propagateDetail(const uint64_t _node) noexcept
+    {
+      uint64_t stack[2*(FrameLocation::max_layer+2)];
+      int top = 0;
+
+      stack[top++] = _node;
+
+      while (top > 0)
+      {
+        const uint64_t node = stack[--top];
+
+        for (int side = 0; side < 2; ++side)
+        {
+          const uint64_t child = side ? rightChild(node) : leftChild(node);
+          const float value = this->childValue(node, side);
+
+          if (!this->isPresent(child) || (this->values[child] == value))
+            continue;
+
+          this->values[child] = value;
+          this->setDirty(child);
+
+          stack[top++] = child;
+        }
+      }
+    }
+
+    /// Same as ImageBSP::foldDeepFrame. The ancestor at the cutoff is
+    /// addressed directly, it normally exists and has a value, so dropping
+    /// a frame is O(1)
+    private: void foldDeepFrame(const int _layer, const uint64_t _node, const float _value) noexcept
+    {
+      const uint64_t path = _node^(uint64_t(1)<<_layer);
+      uint64_t id = nodeIndex(this->layer_cutoff, path&((uint64_t(1)<<this->layer_cutoff)-1));
+
+      while ((id > 1) && !this->isPresent(id))
+        id = parentNode(id);
+
+      if (this->values[id] != this->empty_color)
+        return;
+
+      this->values[id] = _value;
+      this->markPath(id);
+    }
+
+    public: template <typename T = float>
+    ImageMatrixT<T> asImageMatrix(const int _width, ThreadPool *_pool = nullptr) const
+    {
+      int _height = _width*this->ratio;
+      ImageMatrixT<T> image(_width, _height, ColorSpace::Grayscale);
+
+      BSPRasterizer<NodeView>::render(NodeView{this}, image, _pool);
+
+      return std::move(image);
+    }
+
+    /// Renders the whole image scaled to the target, no intermediate buffers
+    public: void render(RenderTarget &_dst, ThreadPool *_pool = nullptr) const
+    {
+      BSPRasterizer<NodeView>::render(NodeView{this}, _dst, _pool);
+    }
+
+    /// Renders into all _count targets in a single pass over the tree
+    public: void render(RenderTarget *_levels, const int _count, ThreadPool *_pool = nullptr) const
+    {
+      BSPRasterizer<NodeView>::renderLevels(NodeView{this}, _levels, _count, _pool);
+    }
+
+    /// asImageMatrix at _width, _width/2, _width/4... for _count levels
+    public: template <typename T = float>
+    std::vector<ImageMatrixT<T>> asImagePyramid(const int _width, const int _count, ThreadPool *_pool = nullptr) const
+    {
+      std::vector<ImageMatrixT<T>> levels;
+      levels.reserve(_count);
+
+      for (int k = 0; k < _count; ++k)
+      {
+        const int width = std::max(_width>>k, 1);
+        levels.emplace_back(width, static_cast<int>(width*this->ratio), ColorSpace::Grayscale);
+      }
+
+      BSPRasterizer<NodeView>::renderLevels(NodeView{this}, levels.data(), _count, _pool);
+
+      return std::move(levels);
+    }
+
+    /// Renders _viewport, in source pixels, scaled to the whole target
+    public: void render(RenderTarget &_dst, const Rect &_viewport, ThreadPool *_pool = nullptr) const
+    {
+      BSPRasterizer<NodeView>::render(NodeView{this}, _dst, this->sourceRect(), _viewport, _pool);
+    }
+
+    public: template <typename T = float>
+    ImageMatrixT<T> asImageMatrix(const Rect &_viewport, const int _width, const int _height,
+        ThreadPool *_pool = nullptr) const
+    {
+      ImageMatrixT<T> image(_width, _height, ColorSpace::Grayscale);
+
+      BSPRasterizer<NodeView>::render(NodeView{this}, image, this->sourceRect(), _viewport, _pool);
+
+      return std::move(image);
+    }
+
+    /// Updates a persistent target with what changed since the last call,
+    /// returns the bounds of the redrawn area. _dst keeps its size between
+    /// calls, otherwise invalidate() first.
+    public: template <typename Target>
+    Rect renderDirty(Target &_dst, ThreadPool *_pool = nullptr)
+    {
+      Rect changed = BSPRasterizer<DirtyNodeView>::renderDirty(DirtyNodeView{this}, _dst, this->redraw_all, _pool);
+      this->redraw_all = false;
+
+      return changed;
+    }
+
+    /// Next renderDirty redraws everything
+    public: void invalidate() noexcept
+    {
+      this->redraw_all = true;
+    }
+
+    /// Frame of the encoded image, in its own pixels
+    public: Rect sourceRect() const noexcept
+    {
+      return Rect(0, 0, static_cast<int>(this->width), static_cast<int>(std::lround(this->width*this->ratio)));
+    }
+
+    protected: struct NodeView
+    {
+      using Node = uint64_t;
+
+      const FlatImageBSP *bsp;
+
+      Node root() const noexcept { return 1; }
+      Node left(const Node _node) const noexcept { return leftChild(_node); }
+      Node right(const Node _node) const noexcept { return rightChild(_node); }
+      float value(const Node _node) const noexcept { return this->bsp->values[_node]; }
+      bool exists(const Node _node) const noexcept { return this->bsp->isPresent(_node); }
+    };
+
+    // tiles clean disjoint subtrees concurrently, a bitmap word can span
+    // two of them, so clearing is atomic
+    protected: struct DirtyNodeView: public NodeView
+    {
+      FlatImageBSP *owner;
+
+      DirtyNodeView(FlatImageBSP *_owner):
+          NodeView{_owner}, owner(_owner)
+      { }
+
+      bool dirty(const Node _node) const noexcept
+      {
+        return __atomic_load_n(&this->owner->dirty[_node>>6], __ATOMIC_RELAXED) & (uint64_t(1)<<(_node&63));
+      }
+
+      void clean(const Node _node) const noexcept
+      {
+        __atomic_fetch_and(&this->owner->dirty[_node>>6], ~(uint64_t(1)<<(_node&63)), __ATOMIC_RELAXED);
+      }
+    };
+
+    public: void repair(ThreadPool *_pool = nullptr)
+    {
+      this->repairLayers(false, _pool);
+    }
+
+    /// repair() limited to subtrees changed since the last renderDirty, the
+    /// rest was repaired before it was drawn
+    public: void repairDirty(ThreadPool *_pool = nullptr)
+    {
+      this->repairLayers(true, _pool);
+    }
+
+    /// Bottom-up, a layer at a time, every node from its final children.
+    /// Both children of a run of nodes are runs of the next layer, so a
+    /// bitmap word of 64 nodes is handled at once and words go to the pool
+    /// in chunks. Missing siblings are synthesized in their slots.
+    protected: void repairLayers(const bool _dirty_only, ThreadPool *_pool)
+    {
+      const uint64_t *mask = this->presence.data();
+
+      if (_dirty_only)
+      {
+        this->markRepairSet();
+        mask = this->repair_set.data();
+      }
+
+      for (int l = this->depth-1; l >= 0; --l)
+      {
+        const uint64_t begin = uint64_t(1)<<l;
+
+        if (l < 6)
+        {
+          for (uint64_t id = begin; id < 2*begin; ++id)
+            if (mask[id>>6] & (uint64_t(1)<<(id&63)))
+              this->repairNode(id);
+          continue;
+        }
+
+        const size_t words = begin/64;
+        const size_t chunks = (words+repair_chunk-1)/repair_chunk;
+
+        // chunks own disjoint runs of children, siblings they synthesize
+        // never share a bitmap word
+        auto repair_chunk_words = [this, mask, begin, words](const size_t _id)
+          {
+            const size_t end = std::min((_id+1)*repair_chunk, words);
+
+            for (size_t w = begin/64+_id*repair_chunk; w < begin/64+end; ++w)
+              this->repairWord(w, mask[w]);
+          };
+
+        if (_pool && (chunks > 1))
+          _pool->parallelFor(chunks, repair_chunk_words);
+        else
+          for (size_t i = 0; i < chunks; ++i)
+            repair_chunk_words(i);
+      }
+    }
+
+    // words of one layer per repair task
+    private: static constexpr size_t repair_chunk = 64;
+
+    /// 64 nodes of a layer >= 6, starting at node 64*_word
+    private: void repairWord(const size_t _word, const uint64_t _mask) noexcept
+    {
+      if (!_mask)
+        return;
+
+      const uint64_t first = uint64_t(64)*_word;
+      const uint64_t left = leftChild(first);
+      const uint64_t right = rightChild(first);
+
+      if (right >= this->values.size())
+        return;
+
+      const uint64_t both = _mask & this->presence[left>>6] & this->presence[right>>6];
+
+      if (both == ~uint64_t(0))
+      {
+        float *values = this->values.data();
+
+        for (int k = 0; k < 64; ++k)
+          values[first+k] = (values[left+k]+values[right+k])/2;
+
+        this->dirty[_word] |= this->dirty[left>>6]|this->dirty[right>>6];
+        return;
+      }
+
+      for (uint64_t bits = _mask; bits; bits &= bits-1)
+        this->repairNode(first+__builtin_ctzll(bits));
+    }
+
+    private: void repairNode(const uint64_t _node) noexcept
+    {
+      const uint64_t left = leftChild(_node);
+      const uint64_t right = rightChild(_node);
+      const bool has_left = this->isPresent(left);
+      const bool has_right = this->isPresent(right);
+
+      if (has_left && has_right)
+        this->values[_node] = (this->values[left]+this->values[right])/2;
+      else if (has_left || has_right)
+      {
+        const uint64_t child = has_left ? left : right;
+        const uint64_t sibling = has_left ? right : left;
+
+        if (this->values[_node] == this->empty_color)
+          this->values[_node] = this->values[child];
+        else
+        {
+          // sibling slot is already allocated, it only has to be marked
+          this->values[sibling] = this->values[_node]*2-this->values[child];
+          this->setPresent(sibling);
+          this->setDirty(sibling);
+        }
+      }
+
+      // same as ImageBSP::repairNode, a dirty child dirties its parent
+      if ((this->isPresent(left) && this->isDirty(left)) || (this->isPresent(right) && this->isDirty(right)))
+        this->setDirty(_node);
+    }
+
+    /// Dirty nodes whose ancestors are all dirty, a clean node was drawn
+    /// with its value and what's below it is left for later
+    private: void markRepairSet()
+    {
+      this->repair_set.assign(this->presence.size(), 0);
+
+      uint64_t *set = this->repair_set.data();
+      auto marked = [set](const uint64_t _id) { return (set[_id>>6]>>(_id&63))&1; };
+
+      if (this->isDirty(1))
+        set[0] |= uint64_t(2);
+
+      for (int l = 0; l+1 < this->depth; ++l)
+      {
+        const uint64_t begin = uint64_t(1)<<l;
+
+        if (l < 6)
+        {
+          for (uint64_t id = begin; id < 2*begin; ++id)
+            if (marked(id))
+              for (const uint64_t child : {leftChild(id), rightChild(id)})
+                if (this->isPresent(child) && this->isDirty(child))
+                  set[child>>6] |= uint64_t(1)<<(child&63);
+          continue;
+        }
+
+        // a word of parents lines up with a word of either children
+        for (uint64_t w = begin/64; w < 2*begin/64; ++w)
+        {
+          const uint64_t left = leftChild(64*w)>>6;
+          const uint64_t right = rightChild(64*w)>>6;
+
+          set[left] = set[w] & this->presence[left] & this->dirty[left];
+          set[right] = set[w] & this->presence[right] & this->dirty[right];
+        }
+      }
+    }
+  };
+};
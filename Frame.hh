@@ -1,106 +1,165 @@
+#pragma once
+
 #include <cassert>
+#include <cmath>
+#include <cstring>
 #include <ctime>
 #include <iostream>
 
 #include <algorithm>
-#include <random>
 #include <tuple>
+#include <type_traits>
 #include <memory>
+#include <functional>
+#include <limits>
 #include <map>
+#include <mutex>
 #include <vector>
 
+#include "NodeAllocator.hh"
+#include "ThreadPool.hh"
+#include "TileKernels.hh"
+
 
 namespace BIVCodec
 {
   // To keep PoC simple enough, support Grayscale images only;
-  enum class ColorSpace : int
+  enum class ColorSpace : uint8_t
   {
     Grayscale = 0,
     HSL = 1,
     RGB = 2
   };
 
+  /// Node address, bit i of the path is the branch taken at layer i.
+  /// Packed into one word, layers deeper than 24 don't fit the wire though.
   struct FrameLocation
   {
-    std::vector<bool> path;
-    int layer;
-    int location_id;
+    static constexpr int max_layer = 56;
+    static constexpr int wire_layers = 24;
+
+    uint64_t path : 56;
+    uint64_t layer : 8;
+
+    constexpr FrameLocation():
+        path(0), layer(0)
+    { }
+
+    constexpr FrameLocation(const uint64_t _path, const int _layer):
+        path(_path), layer(_layer)
+    { }
 
     bool Path(const int _layer) const noexcept
     {
       assert(_layer <= layer);
-      return path[_layer];
+      return (path>>_layer)&1;
+    }
+
+    uint64_t fuse() const noexcept
+    {
+      return path;
     }
 
-    uint32_t fuse() const noexcept
+    void defuse(const uint64_t _fusion, const int _layer) noexcept
     {
-      uint32_t fusion = 0;
+      assert(_layer <= max_layer);
 
-      for (int i = 0; i < path.size(); ++i)
-      {
-        if (path[i])
-          fusion |= 1u<<i;
-      }
+      layer = _layer;
+      path = _fusion & ((uint64_t(1)<<_layer)-1);
+    }
 
-      return fusion;
+    FrameLocation child(const bool _right) const noexcept
+    {
+      assert(layer < max_layer);
+      return FrameLocation(path|(uint64_t(_right)<<layer), layer+1);
     }
 
-    void defuse(const uint32_t _fusion, const int _layer) noexcept
+    FrameLocation parent() const noexcept
     {
-      layer = _layer;
+      assert(layer > 0);
+      return FrameLocation(path&((uint64_t(1)<<(layer-1))-1), layer-1);
+    }
+
+    FrameLocation sibling() const noexcept
+    {
+      assert(layer > 0);
+      return FrameLocation(path^(uint64_t(1)<<(layer-1)), layer);
+    }
 
-      path.clear();
-      for (int i = 0; i < layer; ++i)
-        path.push_back(_fusion & (1u<<i));
+    /// (1<<layer)|path, unique over all layers
+    uint64_t index() const noexcept
+    {
+      return (uint64_t(1)<<layer)|path;
     }
 
-    bool operator==(const FrameLocation &_a)
+    bool operator==(const FrameLocation &_a) const noexcept
     {
-      return path == _a.path;
+      return (path == _a.path) && (layer == _a.layer);
     }
   };
 
   struct FrameHeader
   {
-    enum class HeaderType : int {Image = 0, Sync = 1};
+    enum class HeaderType : uint8_t {Image = 0, Sync = 1, Detail = 2};
     HeaderType type;
   };
 
-  struct FrameData
-  { };
+  // Both frame kinds start with their header, so Frame can read the tag
+  // through either of them
 
-  struct FrameSyncData: public FrameData
+  struct FrameSyncData
   {
     // CodecType codec_type;
     // CodecVersion codec_version;
 
-    using FrameSourceWidth = int;
+    using FrameSourceWidth = uint16_t;
     using FrameSourceRatio = float;
-    using FrameID = int;
+    using FrameID = uint8_t;
     using Timestamp = uint32_t;
 
-    FrameSourceWidth width;
-    FrameSourceRatio ratio;
+    FrameHeader header {FrameHeader::HeaderType::Sync};
+
+    FrameID id = 0;
+    FrameSourceWidth width = 0;
+    FrameSourceRatio ratio = 1.f;
+
+    ColorSpace color_format = ColorSpace::Grayscale;
+
+    // root mean of a detail coded chain, -1 for pair coded ones
+    int16_t mean = -1;
 
-    ColorSpace color_format;
+    Timestamp timestamp = 0;
 
-    FrameID id;
-    Timestamp timestamp;
+    static inline int16_t quantizeMean(const float _value) noexcept
+    {
+      return static_cast<int16_t>(std::lround(std::min(std::max(_value, 0.f), 255.f)));
+    }
 
-    bool operator==(const FrameSyncData &_a)
+    bool operator==(const FrameSyncData &_a) const
     {
       return width == _a.width;
     }
   };
 
-  struct FrameImageData: public FrameData
+  struct FrameImageData
   {
+    // values travel as 8 bit on the wire, frames carry exactly that
+    using Value = uint8_t;
+
+    FrameHeader header {FrameHeader::HeaderType::Image};
+
+    uint8_t channel = 0;
+    Value value_l = 0;
+    Value value_r = 0;
+
     FrameLocation location;
-    int channel;
-    float value_l;
-    float value_r;
 
-    bool operator==(const FrameImageData &_a)
+    static inline Value quantize(const float _value) noexcept
+    {
+      return static_cast<Value>(std::min(std::max(_value, 0.f), 255.f));
+    }
+
+    bool operator==(const FrameImageData &_a) const
     {
       return (location == _a.location) &&
              (channel == _a.channel) &&
@@ -109,138 +168,399 @@ namespace BIVCodec
     }
   };
 
+  /// Haar coded node, only the difference between the two children travels.
+  /// They are rebuilt from the node's own value, known from the layers
+  /// above, by integer lifting, left = value+floor((d+1)/2), right = left-d.
+  /// Senders code integer values lifted up from the rounded leaves,
+  /// floor((left+right)/2) at every node, so the leaves come back exact
+  /// wherever the differences fit the code. Codes are companded, exact up
+  /// to 64 and coarser up to 252.
+  struct FrameDetailData
+  {
+    using Code = int8_t;
+
+    static constexpr Code max_code = 127;
+
+    FrameHeader header {FrameHeader::HeaderType::Detail};
+
+    uint8_t channel = 0;
+    Code detail = 0;
+
+    FrameLocation location;
+
+    /// Nearest code of value_l-value_r
+    static inline Code quantize(const float _difference) noexcept
+    {
+      const float magnitude = std::abs(_difference);
+
+      int code;
+      if (magnitude < 64.5f)
+        code = std::lround(magnitude);
+      else if (magnitude < 129.f)
+        code = 64+std::lround((magnitude-64.f)/2);
+      else
+        code = std::min<int>(96+std::lround((magnitude-128.f)/4), max_code);
+
+      return static_cast<Code>((_difference < 0) ? -code : code);
+    }
+
+    static inline float difference(const Code _code) noexcept
+    {
+      const int magnitude = std::abs(static_cast<int>(_code));
+
+      float value;
+      if (magnitude <= 64)
+        value = magnitude;
+      else if (magnitude <= 96)
+        value = 64+2*(magnitude-64);
+      else
+        value = 128+4*(magnitude-96);
+
+      return (_code < 0) ? -value : value;
+    }
+
+    /// Value of child _side of a node the decoder holds at _value. A guess
+    /// handed down past lost parents can push it out of range, it's clamped
+    /// so it never reads as empty_color
+    static inline float childValue(const float _value, const Code _code, const int _side) noexcept
+    {
+      const float difference = FrameDetailData::difference(_code);
+      const float left = _value+std::floor((difference+1)/2);
+
+      return std::min(std::max((_side == 0) ? left : left-difference, 0.f), 255.f);
+    }
+
+    /// Code that brings the children of a node the decoder holds at _value
+    /// nearest to _left and _right. Senders pass the value the decoder will
+    /// have, not their own, so that a coarse code isn't carried further down
+    static inline Code quantize(const float _value, const float _left, const float _right) noexcept
+    {
+      const int nearest = quantize(_left-_right);
+
+      Code best = nearest;
+      float best_error = std::numeric_limits<float>::max();
+
+      // the neighbours differ in parity, which moves the children's mean
+      for (int code = std::max(nearest-1, -static_cast<int>(max_code));
+           code <= std::min(nearest+1, static_cast<int>(max_code)); ++code)
+      {
+        const float left = childValue(_value, code, 0)-_left;
+        const float right = childValue(_value, code, 1)-_right;
+
+        if (left*left+right*right < best_error)
+        {
+          best = code;
+          best_error = left*left+right*right;
+        }
+      }
+
+      return best;
+    }
+
+    /// Value senders code at a node, lifted from those of its children
+    static inline int liftValue(const int _left, const int _right) noexcept
+    {
+      return (_left+_right)>>1;
+    }
+
+    bool operator==(const FrameDetailData &_a) const
+    {
+      return (location == _a.location) &&
+             (channel == _a.channel) &&
+             (detail == _a.detail);
+    }
+  };
+
+  /// Tagged union of the frame kinds, trivially copyable, so a chain is
+  /// a flat array that can be memcpy'd
   struct Frame
   {
-    FrameHeader header;
-    std::shared_ptr<FrameData> data;
+    union
+    {
+      FrameHeader header;
+      FrameImageData image;
+      FrameSyncData sync;
+      FrameDetailData detail;
+    };
+
+    Frame():
+        image()
+    { }
+
+    Frame(const FrameImageData &_image):
+        image(_image)
+    { }
+
+    Frame(const FrameSyncData &_sync):
+        sync(_sync)
+    { }
+
+    Frame(const FrameDetailData &_detail):
+        detail(_detail)
+    { }
+
+    bool isImage() const noexcept
+    {
+      return header.type == FrameHeader::HeaderType::Image;
+    }
+
+    bool isDetail() const noexcept
+    {
+      return header.type == FrameHeader::HeaderType::Detail;
+    }
+
+    bool isSync() const noexcept
+    {
+      return header.type == FrameHeader::HeaderType::Sync;
+    }
+
+    // image and sync records, detail ones are a byte shorter
+    static constexpr size_t wire_size = 8;
+    static constexpr size_t detail_wire_size = 7;
+
+    // type byte of a sync record whose id byte carries the root mean
+    static constexpr uint8_t mean_flag = 0x80;
 
-    std::vector<uint8_t> serialize()
+    /// Size of the record starting with _type
+    static inline size_t recordSize(const uint8_t _type) noexcept
     {
-      std::vector<uint8_t> binary_data;
+      return (_type == static_cast<uint8_t>(FrameHeader::HeaderType::Detail)) ? detail_wire_size : wire_size;
+    }
+
+    size_t wireSize() const noexcept
+    {
+      return recordSize(static_cast<uint8_t>(header.type));
+    }
+
+    /// Wire record of an image frame, _dst has to hold wire_size bytes
+    static void writeImageRecord(uint8_t *_dst, const int _layer, const uint64_t _path, const int _channel,
+        const float _value_l, const float _value_r) noexcept
+    {
+      _dst[0] = static_cast<uint8_t>(FrameHeader::HeaderType::Image);
+      _dst[1] = _layer;
+      _dst[2] = _path;
+      _dst[3] = _path>>8;
+      _dst[4] = _path>>16;
+      _dst[5] = static_cast<uint8_t>(_channel);
+      _dst[6] = FrameImageData::quantize(_value_l);
+      _dst[7] = FrameImageData::quantize(_value_r);
+    }
+
+    /// Wire record of a detail frame, _dst has to hold detail_wire_size bytes
+    static void writeDetailRecord(uint8_t *_dst, const int _layer, const uint64_t _path, const int _channel,
+        const FrameDetailData::Code _detail) noexcept
+    {
+      _dst[0] = static_cast<uint8_t>(FrameHeader::HeaderType::Detail);
+      _dst[1] = _layer;
+      _dst[2] = _path;
+      _dst[3] = _path>>8;
+      _dst[4] = _path>>16;
+      _dst[5] = static_cast<uint8_t>(_channel);
+      _dst[6] = static_cast<uint8_t>(_detail);
+    }
 
-      binary_data.push_back(static_cast<uint8_t>(header.type));
+    /// A sync with a root mean sends it instead of the id, senders use -1
+    static void writeSyncRecord(uint8_t *_dst, const FrameSyncData &_sync) noexcept
+    {
+      const bool mean = (_sync.mean >= 0);
+
+      _dst[0] = static_cast<uint8_t>(FrameHeader::HeaderType::Sync)|(mean ? mean_flag : 0);
+      _dst[1] = _sync.width%256;
+      _dst[2] = _sync.width/256;
+      _dst[3] = _sync.ratio*128;
+      _dst[4] = static_cast<uint8_t>(_sync.color_format);
+      _dst[5] = mean ? _sync.mean : _sync.id;
+      _dst[6] = _sync.timestamp%256;
+      _dst[7] = _sync.timestamp/256;
+    }
 
-      if (header.type == FrameHeader::HeaderType::Image)
+    /// Writes the wire record of this frame, _dst has to hold wireSize() bytes
+    void serialize(uint8_t *_dst) const noexcept
+    {
+      if (this->isImage())
       {
-        auto img = std::static_pointer_cast<FrameImageData>(data);
+        assert(image.location.layer <= FrameLocation::wire_layers);
 
-        binary_data.push_back(img->location.layer);
-        uint32_t path = img->location.fuse();
-        binary_data.push_back(path);
-        binary_data.push_back(path>>8);
-        binary_data.push_back(path>>16);
-        binary_data.push_back(static_cast<uint8_t>(img->channel));
-        binary_data.push_back(static_cast<uint8_t>(img->value_l));
-        binary_data.push_back(static_cast<uint8_t>(img->value_r));
+        writeImageRecord(_dst, image.location.layer, image.location.fuse(), image.channel,
+            image.value_l, image.value_r);
       }
-      else
+      else if (this->isDetail())
       {
-        auto sync = std::static_pointer_cast<FrameSyncData>(data);
+        assert(detail.location.layer <= FrameLocation::wire_layers);
 
-        binary_data.push_back(sync->width%256);
-        binary_data.push_back(sync->width/256);
-        binary_data.push_back(sync->ratio*128);
-        binary_data.push_back(static_cast<uint8_t>(sync->color_format));
-        binary_data.push_back(sync->id);
-        binary_data.push_back(sync->timestamp%256);
-        binary_data.push_back(sync->timestamp/256);
+        writeDetailRecord(_dst, detail.location.layer, detail.location.fuse(), detail.channel, detail.detail);
       }
+      else
+        writeSyncRecord(_dst, sync);
+    }
+
+    std::vector<uint8_t> serialize() const
+    {
+      std::vector<uint8_t> binary_data(this->wireSize());
+
+      this->serialize(&binary_data[0]);
 
       return std::move(binary_data);
     }
 
-    void deserialize(const uint8_t *_data)
+    /// Serializes _count frames back to back. Returns the number of bytes
+    /// written, 0 if _capacity is too small
+    static size_t serializeRange(const Frame *_frames, const size_t _count, uint8_t *_dst, const size_t _capacity) noexcept
+    {
+      size_t size = 0;
+      for (size_t i = 0; i < _count; ++i)
+        size += _frames[i].wireSize();
+
+      if (size > _capacity)
+        return 0;
+
+      for (size_t i = 0; i < _count; ++i)
+      {
+        _frames[i].serialize(_dst);
+        _dst += _frames[i].wireSize();
+      }
+
+      return size;
+    }
+
+    static size_t serializeRange(const std::vector<Frame> &_frames, uint8_t *_dst, const size_t _capacity) noexcept
+    {
+      return serializeRange(_frames.data(), _frames.size(), _dst, _capacity);
+    }
+
+    /// Deserializes every whole record of _src into _frames, damaged ones
+    /// are skipped. Returns the number of frames written, at most _capacity
+    static size_t deserializeRange(const uint8_t *_src, const size_t _size, Frame *_frames, const size_t _capacity) noexcept
+    {
+      size_t count = 0;
+
+      for (size_t offset = 0; (count < _capacity) && (offset < _size); )
+      {
+        const size_t size = recordSize(_src[offset]);
+
+        if (offset+size > _size)
+          break;
+
+        if (_frames[count].deserialize(_src+offset))
+          count++;
+
+        offset += size;
+      }
+
+      return count;
+    }
+
+    /// Returns false if the record can't be valid, a layer too deep for the
+    /// wire, the frame is left unspecified then
+    bool deserialize(const uint8_t *_data) noexcept
     {
       assert(_data != nullptr);
 
-      header.type = static_cast<FrameHeader::HeaderType>(_data[0]);
+      const bool located = (static_cast<FrameHeader::HeaderType>(_data[0]) == FrameHeader::HeaderType::Image) ||
+                           (static_cast<FrameHeader::HeaderType>(_data[0]) == FrameHeader::HeaderType::Detail);
 
-      if (header.type == FrameHeader::HeaderType::Image)
+      if (located && (_data[1] > FrameLocation::wire_layers))
+        return false;
+
+      if (static_cast<FrameHeader::HeaderType>(_data[0]) == FrameHeader::HeaderType::Image)
       {
-        std::shared_ptr<FrameImageData> img;
+        image = FrameImageData();
 
-        if (!data)
-        {
-          img = std::make_shared<FrameImageData>();
-          data = std::static_pointer_cast<FrameData>(img);
-        }
-        else
-          img = std::static_pointer_cast<FrameImageData>(data);
+        image.location.defuse(
+          static_cast<uint32_t>(_data[2])|
+          static_cast<uint32_t>(_data[3])<<8|
+          static_cast<uint32_t>(_data[4])<<16,
+          _data[1]);
+        image.channel = _data[5];
+        image.value_l = _data[6];
+        image.value_r = _data[7];
+      }
+      else if (static_cast<FrameHeader::HeaderType>(_data[0]) == FrameHeader::HeaderType::Detail)
+      {
+        detail = FrameDetailData();
 
-        img->location.defuse(
+        detail.location.defuse(
           static_cast<uint32_t>(_data[2])|
           static_cast<uint32_t>(_data[3])<<8|
           static_cast<uint32_t>(_data[4])<<16,
           _data[1]);
-        img->channel = _data[5];
-        img->value_l = _data[6];
-        img->value_r = _data[7];
+        detail.channel = _data[5];
+        detail.detail = static_cast<FrameDetailData::Code>(_data[6]);
       }
       else
       {
-        std::shared_ptr<FrameSyncData> sync;
+        sync = FrameSyncData();
 
-        if (!data)
+        sync.width = _data[1]|(_data[2]<<8);
+        sync.ratio = _data[3]/128.f;
+        sync.color_format = static_cast<ColorSpace>(_data[4]);
+        sync.timestamp = _data[6]|(_data[7]<<8);
+
+        if (_data[0] & mean_flag)
         {
-          sync = std::make_shared<FrameSyncData>();
-          data = std::static_pointer_cast<FrameData>(sync);
+          sync.id = -1;
+          sync.mean = _data[5];
         }
         else
-          sync = std::static_pointer_cast<FrameSyncData>(data);
-
-        sync->width = _data[1]|(_data[2]<<8);
-        sync->ratio = _data[3]/128.f;
-        sync->color_format = static_cast<ColorSpace>(_data[4]);
-        sync->id = _data[5];
-        sync->timestamp = _data[6]|(_data[7]<<8);
+          sync.id = _data[5];
       }
+
+      return true;
     }
 
-    bool operator==(const Frame &_a)
+    bool operator==(const Frame &_a) const
     {
       bool eq = (header.type == _a.header.type);
 
       if (eq)
       {
-        if (header.type == FrameHeader::HeaderType::Image)
-          eq &= (*std::static_pointer_cast<FrameImageData>(data) == *std::static_pointer_cast<FrameImageData>(_a.data));
+        if (this->isImage())
+          eq &= (image == _a.image);
+        else if (this->isDetail())
+          eq &= (detail == _a.detail);
         else
-          eq &= (*std::static_pointer_cast<FrameSyncData>(data) == *std::static_pointer_cast<FrameSyncData>(_a.data));
+          eq &= (sync == _a.sync);
       }
 
       return eq;
     }
 
-    void dump()
+    void dump() const
     {
       std::cout << "{'header_type:";
 
-      if (header.type == FrameHeader::HeaderType::Image)
+      if (this->isImage())
       {
-        auto img = std::static_pointer_cast<FrameImageData>(data);
-
         std::cout << "'image',"
-                  << "'chann':" << img->channel
-                  << ",'val_l':" << img->value_l
-                  << ",'val_r':" << img->value_r
-                  << ",'location':{'layer':" << img->location.layer
+                  << "'chann':" << int(image.channel)
+                  << ",'val_l':" << int(image.value_l)
+                  << ",'val_r':" << int(image.value_r)
+                  << ",'location':{'layer':" << image.location.layer
                   << ",'path':[";
 
-        for (auto item : img->location.path)
-          std::cout << "'" << item << "',";
+        for (int i = 0; i < image.location.layer; ++i)
+          std::cout << "'" << image.location.Path(i) << "',";
         std::cout << "\b]}";
 
         std::cout << "}" << std::endl;
       }
+      else if (this->isDetail())
+      {
+        std::cout << "'detail',"
+                  << "'chann':" << int(detail.channel)
+                  << ",'detail':" << int(detail.detail)
+                  << ",'location':{'layer':" << detail.location.layer << "}}" << std::endl;
+      }
       else
       {
-        auto sync = std::static_pointer_cast<FrameSyncData>(data);
-
         std::cout << "'sync',..." << "}" << std::endl;
       }
     }
   };
 
+  static_assert(sizeof(Frame) <= 16, "Frame has to stay compact");
+  static_assert(std::is_trivially_copyable<Frame>::value, "Frame chains are memcpy'd");
+
   struct Rect
   {
     int x = 0;
@@ -285,431 +605,2307 @@ namespace BIVCodec
                _rect.height-(_rect.height/2)));
   }
 
-  class ImageMatrix
+  /// Transmission order of one layer, position k carries node number
+  /// permutation(k) of the layer, nodes numbered left to right. A Feistel
+  /// network over the next power of two, walked until it lands in range,
+  /// so any position is computed on its own in O(1) expected time.
+  class LayerPermutation
   {
-    public: int width;
-    public: int height;
-    private: ColorSpace color_mode;
-
-    private: std::vector<float> image_data;
+    private: static constexpr int rounds = 4;
 
-    public: ImageMatrix(ImageMatrix &&_src):
-        width(_src.width), height(_src.height), color_mode(_src.color_mode),
-        image_data(std::move(_src.image_data))
-    { }
+    private: uint64_t count;
+    // halves of the domain, left_bits+right_bits wide, rounds alternate
+    // between them so they needn't be equal
+    private: int left_bits = 1;
+    private: int right_bits = 1;
+    private: uint64_t keys[rounds];
 
-    public: ImageMatrix(const int _width, const int _height,
-        const ColorSpace _mode = ColorSpace::Grayscale, const void *_data = nullptr):
-        width(_width), height(_height), color_mode(_mode),
-        image_data(_width*_height, 0.f)
+    public: LayerPermutation(const uint64_t _count, const uint32_t _key) noexcept:
+        count(_count)
     {
-      if (_data)
-      {
-        const uint8_t *data = reinterpret_cast<const uint8_t *>(_data);
-        for (size_t i = 0; i < _width*_height; ++i)
-          this->image_data[i] = data[i];
-      }
+      assert(_count > 0);
+
+      int bits = 2;
+      while ((uint64_t(1)<<bits) < _count)
+        bits++;
+
+      this->left_bits = bits/2;
+      this->right_bits = bits-this->left_bits;
+
+      for (int i = 0; i < rounds; ++i)
+        this->keys[i] = (uint64_t(_key)<<32|uint64_t(i))*0xd6e8feb86659fd93ull;
     }
 
-    public: ImageMatrix &operator=(const ImageMatrix &_src)
+    public: uint64_t operator()(const uint64_t _position) const noexcept
     {
-      this->width = _src.width;
-      this->height = _src.height;
-      this->color_mode = _src.color_mode;
+      assert(_position < this->count);
 
-      this->image_data = _src.image_data;
+      uint64_t x = _position;
 
-      return *this;
+      // the network is a bijection of the whole domain, so walking its
+      // cycle from an in-range value always returns in range
+      do
+        x = this->encrypt(x);
+      while (x >= this->count);
+
+      return x;
     }
 
-    public: ImageMatrix &operator=(const ImageMatrix &&_src)
+    private: uint64_t encrypt(const uint64_t _x) const noexcept
     {
-      this->width = _src.width;
-      this->height = _src.height;
-      this->color_mode = _src.color_mode;
+      uint64_t l = _x>>this->right_bits;
+      uint64_t r = _x&((uint64_t(1)<<this->right_bits)-1);
 
-      this->image_data = std::move(_src.image_data);
+      for (int i = 0; i < rounds; i += 2)
+      {
+        l ^= round(r, this->keys[i], this->left_bits);
+        r ^= round(l, this->keys[i+1], this->right_bits);
+      }
 
-      return *this;
+      return (l<<this->right_bits)|r;
     }
 
-    public: float *data() noexcept
+    // multiply-shift hash, top _bits of the product
+    private: static inline uint64_t round(const uint64_t _x, const uint64_t _key, const int _bits) noexcept
     {
-      return &this->image_data[0];
+      return ((_x^_key)*0x9e3779b97f4a7c15ull)>>(64-_bits);
     }
+  };
 
-    public: inline float getFragment(const int _x, const int _y, const int _channel = 0) const noexcept
+  /// Split geometry of a whole tree, for one (width, height, layers). Nodes
+  /// that get framed are stored layer by layer, every layer left to right as
+  /// the encoders emit it; children refer either to a node or, as ~index, to
+  /// a leaf. A leaf covers one pixel unless the layer limit cut it short.
+  /// Plans are immutable and shared, video of a fixed size builds one once.
+  class GeometryPlan
+  {
+    public: struct PlanRect
     {
-      assert((_x >= 0) && (_x < this->width));
-      assert((_y >= 0) && (_y < this->height));
+      uint16_t x;
+      uint16_t y;
+      uint16_t width;
+      uint16_t height;
 
-      return this->image_data[_y*this->width + _x];
-    }
+      inline Rect rect() const noexcept
+      { return Rect(this->x, this->y, this->width, this->height); }
+
+      inline bool isHorizontal() const noexcept
+      { return this->width > this->height; }
+    };
 
-    public: inline float getFragment(const int _id) const noexcept
+    public: struct Node
     {
-      assert((_id >= 0) && (_id < this->width*this->height));
+      uint32_t path;
+      int32_t left;
+      int32_t right;
+      PlanRect roi;
+    };
 
-      return this->image_data[_id];
-    }
+    // same as ImageBSP::max_layers
+    public: static constexpr int default_layers = FrameLocation::wire_layers+1;
 
-    public: inline void setFragment(const int _x, const int _y, const int _channel, const float _value) noexcept
-    {
-      assert((_x >= 0) && (_x < this->width));
-      assert((_y >= 0) && (_y < this->height));
+    public: const int width;
+    public: const int height;
+    public: const int layers;
 
-      this->image_data[_y*this->width + _x] = _value;
-    }
+    // root is a node unless the whole image is a leaf
+    public: int32_t root = ~0;
+
+    public: std::vector<Node> nodes;
+    public: std::vector<PlanRect> leaves;
+    // nodes of layer L are [layer_begin[L], layer_begin[L+1])
+    public: std::vector<size_t> layer_begin;
 
-    public: inline void setFragment(const int _id, const float _value) noexcept
+    public: GeometryPlan(const int _width, const int _height, const int _layers):
+        width(_width), height(_height), layers(_layers)
     {
-      assert((_id >= 0) && (_id < this->width*this->height));
+      assert((_width >= 0) && (_width <= 0xffff));
+      assert((_height >= 0) && (_height <= 0xffff));
+      assert((_layers >= 0) && (_layers <= default_layers));
 
-      this->image_data[_id] = _value;
+      this->build();
     }
 
-    public: float getAverageValue(const Rect &_roi) const
+    public: static inline bool isLeaf(const Rect &_roi, const int _layer, const int _layers) noexcept
     {
-      float acc = 0;
-
-      for (int i = 0; i < _roi.width; ++i)
-        for (int j = 0; j < _roi.height; ++j)
-          acc += this->getFragment(_roi.x+i, _roi.y+j, 0);
-
-      return acc/(_roi.width*_roi.height);
+      return (std::max(_roi.width,_roi.height) <= 1) || (_layer >= _layers);
     }
 
-    public: void fillRect(const Rect &_roi, const float _value) noexcept
+    public: size_t layerSize(const int _layer) const noexcept
     {
-      for (int i = 0; i < _roi.width; ++i)
-        for (int j = 0; j < _roi.height; ++j)
-          this->setFragment(_roi.x+i, _roi.y+j, 0, _value);
+      return this->layer_begin[_layer+1]-this->layer_begin[_layer];
     }
-  };
-
-  ImageMatrix matrixMap(const ImageMatrix &_a, std::function<float(float)> _fun)
-  {
-    ImageMatrix _b(_a.width, _a.height, ColorSpace::Grayscale);
 
-    for (int i = 0; i < _b.width*_b.height; ++i)
-      _b.setFragment(i, _fun(_a.getFragment(i)));
+    /// Shared plan of the given geometry, built on first use
+    public: static std::shared_ptr<const GeometryPlan> get(const int _width, const int _height, const int _layers)
+    {
+      if (_layers == default_layers)
+      {
+        // sizes known up front resolve without taking the cache lock
+        if ((_width == 64) && (_height == 64))
+          return fixed<64, 64>();
+        if ((_width == 128) && (_height == 128))
+          return fixed<128, 128>();
+        if ((_width == 1920) && (_height == 1080))
+          return fixed<1920, 1080>();
+      }
 
-    return std::move(_b);
-  }
+      static std::mutex lock;
+      static std::map<std::tuple<int, int, int>, std::shared_ptr<const GeometryPlan>> cache;
 
-  ImageMatrix matrixMap2(const ImageMatrix &_a, const ImageMatrix &_b, std::function<float(float,float)> _fun)
-  {
-    assert(_a.width == _b.width);
-    assert(_a.height == _b.height);
+      std::lock_guard<std::mutex> guard(lock);
 
-    ImageMatrix _c(_a.width, _a.height, ColorSpace::Grayscale);
+      const auto key = std::make_tuple(_width, _height, _layers);
 
-    for (int i = 0; i < _b.width*_b.height; ++i)
-      _c.setFragment(i, _fun(_a.getFragment(i), _b.getFragment(i)));
+      auto found = cache.find(key);
+      if (found != cache.end())
+        return found->second;
 
-    return std::move(_c);
-  }
+      // a stream keeps to a few sizes, anything beyond is churn
+      if (cache.size() >= cache_size)
+        cache.clear();
 
-  class ImageBSP
-  {
-    private: float width = 1.0f;
-    private: float ratio = 1.0f;
-    private: ColorSpace color_mode;
+      auto plan = std::make_shared<const GeometryPlan>(_width, _height, _layers);
+      cache.emplace(key, plan);
 
-    private: const float empty_color = -1.f;
+      return plan;
+    }
 
-    // TODO: Make private
-    public: class ImageNode
+    public: template <int Width, int Height, int Layers = default_layers>
+    static std::shared_ptr<const GeometryPlan> fixed()
     {
-      public: float value = 0.f;
-      public: int layer = 0;
+      static const std::shared_ptr<const GeometryPlan> plan =
+          std::make_shared<const GeometryPlan>(Width, Height, Layers);
 
-      public: std::weak_ptr<ImageNode> parent;
-
-      public: std::shared_ptr<ImageNode> left;
-      public: std::shared_ptr<ImageNode> right;
-
-      public: ImageNode(const float _value, const int _layer):
-          value(_value), layer(_layer)
-      { }
-    };
-
-    private: std::shared_ptr<ImageNode> root_node = std::make_shared<ImageNode>(this->empty_color,0);
-
-    public: int frames = 0;
+      return plan;
+    }
 
-    public: explicit ImageBSP(const ColorSpace _mode):
-        color_mode(_mode)
-    { }
+    private: static constexpr size_t cache_size = 8;
 
-    public: ImageBSP(const ImageMatrix &_src, const ColorSpace _mode)
+    private: int32_t addChild(const Rect &_roi, const int _layer, const uint32_t _path)
     {
-      assert(_src.width >= 2);
-      assert(_src.height >= 1);
+      const PlanRect roi = {
+          static_cast<uint16_t>(_roi.x), static_cast<uint16_t>(_roi.y),
+          static_cast<uint16_t>(_roi.width), static_cast<uint16_t>(_roi.height)};
 
-      this->width = _src.width;
-      this->ratio = static_cast<float>(_src.height)/_src.width;
-      this->color_mode = ColorSpace::Grayscale;
+      if (isLeaf(_roi, _layer, this->layers))
+      {
+        this->leaves.push_back(roi);
+        return ~static_cast<int32_t>(this->leaves.size()-1);
+      }
 
-      this->applyFrameFromMatrixRecursive(_src, Rect(0, 0, _src.width, _src.height), std::vector<bool>());
+      this->nodes.push_back({_path, 0, 0, roi});
+      return static_cast<int32_t>(this->nodes.size()-1);
     }
 
-    /// SINGLETHREAD
-    protected: float applyFrameFromMatrixRecursive(const ImageMatrix &_src, const Rect &_roi, std::vector<bool> _path)
+    private: void build()
+    {
+      this->root = this->addChild(Rect(0, 0, this->width, this->height), 0, 0);
+
+      this->layer_begin.assign(1, 0);
+
+      // children of layer L are appended in order, which makes layer L+1
+      for (int l = 0; this->layer_begin.back() < this->nodes.size(); ++l)
+      {
+        const size_t begin = this->layer_begin.back();
+        const size_t end = this->nodes.size();
+
+        for (size_t i = begin; i < end; ++i)
+        {
+          Rect rect_left;
+          Rect rect_right;
+
+          std::tie(rect_left, rect_right) = splitRect(this->nodes[i].roi.rect());
+
+          const uint32_t path = this->nodes[i].path;
+
+          const int32_t left = this->addChild(rect_left, l+1, path);
+          const int32_t right = this->addChild(rect_right, l+1, path|(uint32_t(1)<<l));
+
+          this->nodes[i].left = left;
+          this->nodes[i].right = right;
+        }
+
+        this->layer_begin.push_back(end);
+      }
+
+      // empty layers up to the limit, so that layerSize works for every layer
+      while (static_cast<int>(this->layer_begin.size()) <= this->layers)
+        this->layer_begin.push_back(this->nodes.size());
+    }
+  };
+
+  template <typename T>
+  struct PixelTraits;
+
+  template <>
+  struct PixelTraits<float>
+  {
+    // getAverageValue accumulator and IntegralImage cell type
+    using Sum = float;
+    using TableSum = double;
+
+    static inline float fromValue(const float _value) noexcept
+    { return _value; }
+  };
+
+  template <>
+  struct PixelTraits<uint8_t>
+  {
+    // 2^24 pixels (24 layers) * 255 still fits 32 bits
+    using Sum = uint32_t;
+    using TableSum = uint32_t;
+
+    static inline uint8_t fromValue(const float _value) noexcept
+    { return static_cast<uint8_t>(std::min(std::max(_value+0.5f, 0.f), 255.f)); }
+  };
+
+  template <typename T>
+  class ImageMatrixT
+  {
+    public: using Pixel = T;
+
+    public: int width;
+    public: int height;
+    private: ColorSpace color_mode;
+
+    private: std::vector<T> image_data;
+
+    public: ImageMatrixT(ImageMatrixT &&_src):
+        width(_src.width), height(_src.height), color_mode(_src.color_mode),
+        image_data(std::move(_src.image_data))
+    { }
+
+    /// _data is 8 bit per pixel, for uint8_t matrices it's copied as is
+    public: ImageMatrixT(const int _width, const int _height,
+        const ColorSpace _mode = ColorSpace::Grayscale, const void *_data = nullptr):
+        width(_width), height(_height), color_mode(_mode),
+        image_data(_width*_height, T(0))
+    {
+      if (_data)
+      {
+        const uint8_t *data = reinterpret_cast<const uint8_t *>(_data);
+        std::copy(data, data+_width*_height, this->image_data.begin());
+      }
+    }
+
+    public: ImageMatrixT &operator=(const ImageMatrixT &_src)
+    {
+      this->width = _src.width;
+      this->height = _src.height;
+      this->color_mode = _src.color_mode;
+
+      this->image_data = _src.image_data;
+
+      return *this;
+    }
+
+    public: ImageMatrixT &operator=(const ImageMatrixT &&_src)
+    {
+      this->width = _src.width;
+      this->height = _src.height;
+      this->color_mode = _src.color_mode;
+
+      this->image_data = std::move(_src.image_data);
+
+      return *this;
+    }
+
+    public: T *data() noexcept
+    {
+      return &this->image_data[0];
+    }
+
+    public: const T *row(const int _y) const noexcept
+    {
+      assert((_y >= 0) && (_y < this->height));
+
+      return &this->image_data[_y*this->width];
+    }
+
+    public: T *row(const int _y) noexcept
+    {
+      assert((_y >= 0) && (_y < this->height));
+
+      return &this->image_data[_y*this->width];
+    }
+
+    public: inline T getFragment(const int _x, const int _y, const int _channel = 0) const noexcept
+    {
+      assert((_x >= 0) && (_x < this->width));
+      assert((_y >= 0) && (_y < this->height));
+
+      return this->image_data[_y*this->width + _x];
+    }
+
+    public: inline T getFragment(const int _id) const noexcept
+    {
+      assert((_id >= 0) && (_id < this->width*this->height));
+
+      return this->image_data[_id];
+    }
+
+    public: inline void setFragment(const int _x, const int _y, const int _channel, const T _value) noexcept
+    {
+      assert((_x >= 0) && (_x < this->width));
+      assert((_y >= 0) && (_y < this->height));
+
+      this->image_data[_y*this->width + _x] = _value;
+    }
+
+    public: inline void setFragment(const int _id, const T _value) noexcept
+    {
+      assert((_id >= 0) && (_id < this->width*this->height));
+
+      this->image_data[_id] = _value;
+    }
+
+    public: float getAverageValue(const Rect &_roi) const
+    {
+      typename PixelTraits<T>::Sum acc = 0;
+
+      for (int i = 0; i < _roi.width; ++i)
+        for (int j = 0; j < _roi.height; ++j)
+          acc += this->getFragment(_roi.x+i, _roi.y+j, 0);
+
+      return static_cast<float>(acc)/(_roi.width*_roi.height);
+    }
+
+    public: void fillRect(const Rect &_roi, const T _value) noexcept
+    {
+      for (int j = 0; j < _roi.height; ++j)
+        TileKernels::fillRow(this->row(_roi.y+j)+_roi.x, _roi.width, _value);
+    }
+  };
+
+  using ImageMatrix = ImageMatrixT<float>;
+  using ImageMatrix8 = ImageMatrixT<uint8_t>;
+
+  enum class PixelFormat : int
+  {
+    Gray8 = 0,
+    BGR8 = 1,     // 3 bytes per pixel, gray replicated
+    BGRA8 = 2     // 4 bytes per pixel, opaque
+  };
+
+  /// Caller owned 8 bit display buffer, e.g. a cv::Mat or a texture upload
+  /// buffer. Rows are _stride bytes apart, so padded and sub-images work.
+  class RenderTarget
+  {
+    public: using Pixel = uint8_t;
+
+    public: uint8_t *data;
+    public: int width;
+    public: int height;
+    public: ptrdiff_t stride;
+    public: PixelFormat format;
+
+    public: RenderTarget(uint8_t *_data, const int _width, const int _height,
+        const ptrdiff_t _stride, const PixelFormat _format = PixelFormat::Gray8):
+        data(_data), width(_width), height(_height), stride(_stride), format(_format)
+    {
+      assert(_data != nullptr);
+      assert(_stride >= _width*channels(_format));
+    }
+
+    public: static int channels(const PixelFormat _format) noexcept
+    {
+      switch (_format)
+      {
+        case PixelFormat::BGR8: return 3;
+        case PixelFormat::BGRA8: return 4;
+        default: return 1;
+      }
+    }
+
+    public: uint8_t *row(const int _y) noexcept
+    {
+      assert((_y >= 0) && (_y < this->height));
+
+      return this->data+_y*this->stride;
+    }
+
+    public: void fillRect(const Rect &_roi, const uint8_t _value) noexcept
+    {
+      switch (this->format)
+      {
+        case PixelFormat::Gray8:
+          for (int j = 0; j < _roi.height; ++j)
+            TileKernels::fillRow(this->row(_roi.y+j)+_roi.x, _roi.width, _value);
+          break;
+
+        case PixelFormat::BGR8:
+          for (int j = 0; j < _roi.height; ++j)
+            TileKernels::fillRow(this->row(_roi.y+j)+3*_roi.x, 3*_roi.width, _value);
+          break;
+
+        case PixelFormat::BGRA8:
+        {
+          if ((_roi.width <= 0) || (_roi.height <= 0))
+            break;
+
+          // the buffer may be unaligned, bytes only, the first row is copied
+          const uint8_t bgra[4] = {_value, _value, _value, 255};
+          uint8_t *const first = this->row(_roi.y)+4*_roi.x;
+
+          for (int i = 0; i < _roi.width; ++i)
+            std::memcpy(first+4*i, bgra, 4);
+
+          for (int j = 1; j < _roi.height; ++j)
+            std::memcpy(this->row(_roi.y+j)+4*_roi.x, first, 4*_roi.width);
+          break;
+        }
+      }
+    }
+  };
+
+  ImageMatrix matrixMap(const ImageMatrix &_a, std::function<float(float)> _fun)
+  {
+    ImageMatrix _b(_a.width, _a.height, ColorSpace::Grayscale);
+
+    for (int i = 0; i < _b.width*_b.height; ++i)
+      _b.setFragment(i, _fun(_a.getFragment(i)));
+
+    return std::move(_b);
+  }
+
+  ImageMatrix matrixMap2(const ImageMatrix &_a, const ImageMatrix &_b, std::function<float(float,float)> _fun)
+  {
+    assert(_a.width == _b.width);
+    assert(_a.height == _b.height);
+
+    ImageMatrix _c(_a.width, _a.height, ColorSpace::Grayscale);
+
+    for (int i = 0; i < _b.width*_b.height; ++i)
+      _c.setFragment(i, _fun(_a.getFragment(i), _b.getFragment(i)));
+
+    return std::move(_c);
+  }
+
+  // Summed-area table over an ImageMatrix, any Rect average is O(1)
+  template <typename T>
+  class IntegralImageT
+  {
+    public: using Sum = typename PixelTraits<T>::TableSum;
+
+    public: int width;
+    public: int height;
+
+    // (width+1)*(height+1), first row and column are zero
+    private: std::vector<Sum> sums;
+
+    public: explicit IntegralImageT(const ImageMatrixT<T> &_src):
+        width(_src.width), height(_src.height),
+        sums((_src.width+1)*(_src.height+1), Sum(0))
+    {
+      const int stride = this->width+1;
+
+      for (int j = 0; j < this->height; ++j)
+      {
+        const T *row = _src.row(j);
+        Sum row_acc = 0;
+
+        for (int i = 0; i < this->width; ++i)
+        {
+          row_acc += row[i];
+          this->sums[(j+1)*stride + i+1] = this->sums[j*stride + i+1] + row_acc;
+        }
+      }
+    }
+
+    public: inline Sum getSum(const Rect &_roi) const noexcept
+    {
+      assert((_roi.x >= 0) && (_roi.x+_roi.width <= this->width));
+      assert((_roi.y >= 0) && (_roi.y+_roi.height <= this->height));
+
+      const int stride = this->width+1;
+      const int x0 = _roi.x;
+      const int y0 = _roi.y;
+      const int x1 = _roi.x+_roi.width;
+      const int y1 = _roi.y+_roi.height;
+
+      return this->sums[y1*stride + x1] - this->sums[y0*stride + x1]
+           - this->sums[y1*stride + x0] + this->sums[y0*stride + x0];
+    }
+
+    public: inline float getAverageValue(const Rect &_roi) const noexcept
+    {
+      return static_cast<double>(this->getSum(_roi))/(_roi.width*_roi.height);
+    }
+  };
+
+  using IntegralImage = IntegralImageT<float>;
+  using IntegralImage8 = IntegralImageT<uint8_t>;
+
+  /// Tiled renderer shared by the BSP backends. The tree is cut into
+  /// subtrees covering at most tile_area pixels, each is rendered on its own
+  /// so it stays in cache, and tiles run in parallel when given a pool.
+  /// Leaf rects never overlap, so every output pixel is written once.
+  /// View gives access to the tree: root(), left(n), right(n), value(n) and
+  /// exists(n), a missing child is a node that doesn't exist. renderDirty
+  /// also needs dirty(n) and clean(n).
+  template <typename View>
+  class BSPRasterizer
+  {
+    public: using Node = typename View::Node;
+
+    public: static constexpr int tile_area = 64*64;
+
+    private: struct Tile
+    {
+      Node node;
+      Rect roi;
+      bool fill;
+      float value;
+    };
+
+    /// Target is an ImageMatrixT or a RenderTarget
+    public: template <typename Target>
+    static void render(const View &_view, Target &_dst, ThreadPool *_pool = nullptr)
+    {
+      std::vector<Tile> tiles;
+      collectTiles(_view, Rect(0, 0, _dst.width, _dst.height), _view.root(), tiles);
+
+      auto render_tile = [&_view, &_dst, &tiles](const size_t _id)
+        {
+          const Tile &tile = tiles[_id];
+
+          if (tile.fill)
+            _dst.fillRect(tile.roi, PixelTraits<typename Target::Pixel>::fromValue(tile.value));
+          else
+            renderRecursive(_view, _dst, tile.roi, tile.node);
+        };
+
+      if (_pool && (tiles.size() > 1))
+        _pool->parallelFor(tiles.size(), render_tile);
+      else
+        for (size_t i = 0; i < tiles.size(); ++i)
+          render_tile(i);
+    }
+
+    public: static constexpr int max_levels = 8;
+
+    // splits until every rect of a tile is down to a pixel, at most log2 of
+    // each side rounded up, plus the call that finds them done
+    private: static constexpr int tile_depth = 14;
+    static_assert((1<<(tile_depth-2)) >= tile_area, "tile_depth is too small for tile_area");
+
+    /// Renders every one of _count targets, e.g. a full, 1/2, 1/4 and 1/8
+    /// size pyramid, in a single pass over the tree. Each target gets the
+    /// same image as a render of its own would give.
+    public: template <typename Target>
+    static void renderLevels(const View &_view, Target *_dst, const int _count, ThreadPool *_pool = nullptr)
+    {
+      assert((_count > 0) && (_count <= max_levels));
+
+      LevelTile root;
+      root.node = _view.root();
+      root.active = (1u<<_count)-1;
+      root.fill = false;
+      root.value = 0.f;
+
+      for (int k = 0; k < _count; ++k)
+        root.rois[k] = Rect(0, 0, _dst[k].width, _dst[k].height);
+
+      std::vector<LevelTile> tiles;
+      collectLevelTiles(_view, _dst, root, tiles);
+
+      auto render_tile = [&_view, _dst, &tiles](const size_t _id)
+        {
+          const LevelTile &tile = tiles[_id];
+
+          if (tile.fill)
+          {
+            fillLevels(_dst, tile.rois, tile.active, tile.value);
+            return;
+          }
+
+          Rect scratch[tile_depth*2*max_levels];
+
+          renderLevelsRecursive(_view, _dst, tile.rois, scratch, tile.active, tile.node);
+        };
+
+      if (_pool && (tiles.size() > 1))
+        _pool->parallelFor(tiles.size(), render_tile);
+      else
+        for (size_t i = 0; i < tiles.size(); ++i)
+          render_tile(i);
+    }
+
+    /// Re-renders only the dirty subtrees into _dst, which has to hold the
+    /// previous render of the same tree at the same size, and cleans them.
+    /// With _all every node is redrawn. Returns the bounds of what changed.
+    public: template <typename Target>
+    static Rect renderDirty(const View &_view, Target &_dst, const bool _all, ThreadPool *_pool = nullptr)
+    {
+      std::vector<Tile> tiles;
+      collectDirtyTiles(_view, Rect(0, 0, _dst.width, _dst.height), _view.root(), _all, tiles);
+
+      auto render_tile = [&_view, &_dst, &tiles, _all](const size_t _id)
+        {
+          const Tile &tile = tiles[_id];
+
+          if (tile.fill)
+            _dst.fillRect(tile.roi, PixelTraits<typename Target::Pixel>::fromValue(tile.value));
+          else
+            renderDirtyRecursive(_view, _dst, tile.roi, tile.node, _all);
+        };
+
+      if (_pool && (tiles.size() > 1))
+        _pool->parallelFor(tiles.size(), render_tile);
+      else
+        for (size_t i = 0; i < tiles.size(); ++i)
+          render_tile(i);
+
+      if (tiles.empty())
+        return Rect();
+
+      int x0 = _dst.width, y0 = _dst.height, x1 = 0, y1 = 0;
+
+      for (const auto &tile : tiles)
+      {
+        x0 = std::min(x0, tile.roi.x);
+        y0 = std::min(y0, tile.roi.y);
+        x1 = std::max(x1, tile.roi.x+tile.roi.width);
+        y1 = std::max(y1, tile.roi.y+tile.roi.height);
+      }
+
+      return Rect(x0, y0, std::max(x1-x0, 0), std::max(y1-y0, 0));
+    }
+
+    /// Renders the part of the image under _viewport, given in source pixels
+    /// of _source, scaled to the whole target. Only nodes intersecting the
+    /// viewport are visited, and none below the size of an output pixel.
+    /// Output pixels outside the source image are left untouched.
+    public: template <typename Target>
+    static void render(const View &_view, Target &_dst, const Rect &_source, const Rect &_viewport,
+        ThreadPool *_pool = nullptr)
+    {
+      assert((_viewport.width > 0) && (_viewport.height > 0));
+
+      const Mapping mapping {_viewport, _dst.width, _dst.height};
+
+      std::vector<Tile> tiles;
+      collectTiles(_view, mapping, _source, _view.root(), tiles);
+
+      auto render_tile = [&_view, &_dst, &mapping, &tiles](const size_t _id)
+        {
+          const Tile &tile = tiles[_id];
+
+          if (tile.fill)
+            _dst.fillRect(mapping.map(tile.roi), PixelTraits<typename Target::Pixel>::fromValue(tile.value));
+          else
+            renderRecursive(_view, _dst, mapping, tile.roi, tile.node);
+        };
+
+      if (_pool && (tiles.size() > 1))
+        _pool->parallelFor(tiles.size(), render_tile);
+      else
+        for (size_t i = 0; i < tiles.size(); ++i)
+          render_tile(i);
+    }
+
+    /// Source to output coordinates. Edges are rounded to the nearest pixel
+    /// boundary, so neighbouring rects share them and never overlap.
+    private: struct Mapping
+    {
+      Rect viewport;
+      int width;
+      int height;
+
+      static int mapEdge(const int _x, const int _from, const int _extent, const int _size) noexcept
+      {
+        if (_x <= _from)
+          return 0;
+
+        if (_x >= _from+_extent)
+          return _size;
+
+        return (2*int64_t(_x-_from)*_size+_extent)/(2*int64_t(_extent));
+      }
+
+      Rect map(const Rect &_roi) const noexcept
+      {
+        const int x0 = mapEdge(_roi.x, viewport.x, viewport.width, width);
+        const int x1 = mapEdge(_roi.x+_roi.width, viewport.x, viewport.width, width);
+        const int y0 = mapEdge(_roi.y, viewport.y, viewport.height, height);
+        const int y1 = mapEdge(_roi.y+_roi.height, viewport.y, viewport.height, height);
+
+        return Rect(x0, y0, x1-x0, y1-y0);
+      }
+    };
+
+    private: static void collectTiles(const View &_view, const Mapping &_mapping, const Rect &_roi, const Node _node,
+        std::vector<Tile> &_tiles)
+    {
+      const Rect out = _mapping.map(_roi);
+
+      if ((out.width == 0) || (out.height == 0))
+        return;
+
+      if (out.width*out.height <= tile_area)
+      {
+        _tiles.push_back({_node, _roi, false, 0.f});
+        return;
+      }
+
+      const Node left = _view.left(_node);
+      const Node right = _view.right(_node);
+
+      if (!_view.exists(left) && !_view.exists(right))
+      {
+        _tiles.push_back({_node, _roi, true, _view.value(_node)});
+        return;
+      }
+
+      Rect rect_left;
+      Rect rect_right;
+
+      std::tie(rect_left, rect_right) = splitRect(_roi);
+
+      if (_view.exists(left))
+        collectTiles(_view, _mapping, rect_left, left, _tiles);
+      else
+        _tiles.push_back({_node, rect_left, true, _view.value(_node)});
+
+      if (_view.exists(right))
+        collectTiles(_view, _mapping, rect_right, right, _tiles);
+      else
+        _tiles.push_back({_node, rect_right, true, _view.value(_node)});
+    }
+
+    private: template <typename Target>
+    static void renderRecursive(const View &_view, Target &_dst, const Mapping &_mapping, const Rect &_roi,
+        const Node _node) noexcept
+    {
+      const Rect out = _mapping.map(_roi);
+
+      if ((out.width == 0) || (out.height == 0))
+        return;
+
+      const auto value = PixelTraits<typename Target::Pixel>::fromValue(_view.value(_node));
+
+      const Node left = _view.left(_node);
+      const Node right = _view.right(_node);
+
+      // deeper layers can't change a single output pixel
+      if ((!_view.exists(left) && !_view.exists(right)) || (std::max(out.width,out.height) <= 1))
+      {
+        _dst.fillRect(out, value);
+        return;
+      }
+
+      Rect rect_left;
+      Rect rect_right;
+
+      std::tie(rect_left, rect_right) = splitRect(_roi);
+
+      if (_view.exists(left))
+        renderRecursive(_view, _dst, _mapping, rect_left, left);
+      else
+        _dst.fillRect(_mapping.map(rect_left), value);
+
+      if (_view.exists(right))
+        renderRecursive(_view, _dst, _mapping, rect_right, right);
+      else
+        _dst.fillRect(_mapping.map(rect_right), value);
+    }
+
+    private: static void collectTiles(const View &_view, const Rect &_roi, const Node _node, std::vector<Tile> &_tiles)
+    {
+      if (_roi.width*_roi.height <= tile_area)
+      {
+        _tiles.push_back({_node, _roi, false, 0.f});
+        return;
+      }
+
+      const Node left = _view.left(_node);
+      const Node right = _view.right(_node);
+
+      if (!_view.exists(left) && !_view.exists(right))
+      {
+        _tiles.push_back({_node, _roi, true, _view.value(_node)});
+        return;
+      }
+
+      Rect rect_left;
+      Rect rect_right;
+
+      std::tie(rect_left, rect_right) = splitRect(_roi);
+
+      if (_view.exists(left))
+        collectTiles(_view, rect_left, left, _tiles);
+      else
+        _tiles.push_back({_node, rect_left, true, _view.value(_node)});
+
+      if (_view.exists(right))
+        collectTiles(_view, rect_right, right, _tiles);
+      else
+        _tiles.push_back({_node, rect_right, true, _view.value(_node)});
+    }
+
+    // one rect per target, levels drop out of active once they're drawn
+    private: struct LevelTile
+    {
+      Node node;
+      Rect rois[max_levels];
+      unsigned active;
+      bool fill;
+      float value;
+    };
+
+    private: template <typename Target>
+    static void fillLevels(Target *_dst, const Rect *_rois, unsigned _active, const float _value) noexcept
+    {
+      const auto value = PixelTraits<typename Target::Pixel>::fromValue(_value);
+
+      for (; _active; _active &= _active-1)
+      {
+        const int k = __builtin_ctz(_active);
+        _dst[k].fillRect(_rois[k], value);
+      }
+    }
+
+    /// Levels whose rect is down to a pixel, or all of them at a leaf, are
+    /// drawn here, the rest is returned
+    private: template <typename Target>
+    static unsigned finishLevels(Target *_dst, const Rect *_rois, const unsigned _active, const bool _leaf,
+        const float _value) noexcept
+    {
+      unsigned done = 0;
+
+      for (unsigned bits = _active; bits; bits &= bits-1)
+      {
+        const int k = __builtin_ctz(bits);
+
+        if (_leaf || (std::max(_rois[k].width,_rois[k].height) <= 1))
+          done |= 1u<<k;
+      }
+
+      fillLevels(_dst, _rois, done, _value);
+
+      return _active&~done;
+    }
+
+    private: static void splitLevels(const Rect *_rois, const unsigned _active, Rect *_left, Rect *_right) noexcept
+    {
+      for (unsigned bits = _active; bits; bits &= bits-1)
+      {
+        const int k = __builtin_ctz(bits);
+        std::tie(_left[k], _right[k]) = splitRect(_rois[k]);
+      }
+    }
+
+    private: template <typename Target>
+    static void collectLevelTiles(const View &_view, Target *_dst, const LevelTile &_tile,
+        std::vector<LevelTile> &_tiles)
+    {
+      int area = 0;
+      for (unsigned bits = _tile.active; bits; bits &= bits-1)
+      {
+        const Rect &roi = _tile.rois[__builtin_ctz(bits)];
+        area = std::max(area, roi.width*roi.height);
+      }
+
+      if (area <= tile_area)
+      {
+        _tiles.push_back(_tile);
+        return;
+      }
+
+      const Node left = _view.left(_tile.node);
+      const Node right = _view.right(_tile.node);
+
+      if (!_view.exists(left) && !_view.exists(right))
+      {
+        LevelTile fill = _tile;
+        fill.fill = true;
+        fill.value = _view.value(_tile.node);
+
+        _tiles.push_back(fill);
+        return;
+      }
+
+      // coarse levels can be down to a pixel already, they're drawn here
+      const float value = _view.value(_tile.node);
+      const unsigned active = finishLevels(_dst, _tile.rois, _tile.active, false, value);
+
+      LevelTile tile_left = _tile;
+      LevelTile tile_right = _tile;
+
+      tile_left.active = active;
+      tile_right.active = active;
+
+      splitLevels(_tile.rois, active, tile_left.rois, tile_right.rois);
+
+      // a missing child is filled with the value of its parent
+      tile_left.fill = !_view.exists(left);
+      tile_left.node = tile_left.fill ? _tile.node : left;
+      tile_left.value = value;
+
+      tile_right.fill = !_view.exists(right);
+      tile_right.node = tile_right.fill ? _tile.node : right;
+      tile_right.value = value;
+
+      if (tile_left.fill)
+        _tiles.push_back(tile_left);
+      else
+        collectLevelTiles(_view, _dst, tile_left, _tiles);
+
+      if (tile_right.fill)
+        _tiles.push_back(tile_right);
+      else
+        collectLevelTiles(_view, _dst, tile_right, _tiles);
+    }
+
+    /// _scratch holds 2*max_levels rects for every split below this one
+    private: template <typename Target>
+    static void renderLevelsRecursive(const View &_view, Target *_dst, const Rect *_rois, Rect *_scratch,
+        const unsigned _active, const Node _node) noexcept
+    {
+      // once the coarse levels are done the rest is a plain render
+      if (!(_active&(_active-1)))
+      {
+        const int k = __builtin_ctz(_active);
+        renderRecursive(_view, _dst[k], _rois[k], _node);
+        return;
+      }
+
+      const Node left = _view.left(_node);
+      const Node right = _view.right(_node);
+      const bool leaf = !_view.exists(left) && !_view.exists(right);
+      const auto value = PixelTraits<typename Target::Pixel>::fromValue(_view.value(_node));
+
+      Rect *rois_left = _scratch;
+      Rect *rois_right = _scratch+max_levels;
+
+      unsigned active = 0;
+
+      for (unsigned bits = _active; bits; bits &= bits-1)
+      {
+        const int k = __builtin_ctz(bits);
+
+        if (leaf || (std::max(_rois[k].width,_rois[k].height) <= 1))
+          _dst[k].fillRect(_rois[k], value);
+        else
+        {
+          std::tie(rois_left[k], rois_right[k]) = splitRect(_rois[k]);
+          active |= 1u<<k;
+        }
+      }
+
+      if (!active)
+        return;
+
+      if (_view.exists(left))
+        renderLevelsRecursive(_view, _dst, rois_left, _scratch+2*max_levels, active, left);
+      else
+        fillLevels(_dst, rois_left, active, _view.value(_node));
+
+      if (_view.exists(right))
+        renderLevelsRecursive(_view, _dst, rois_right, _scratch+2*max_levels, active, right);
+      else
+        fillLevels(_dst, rois_right, active, _view.value(_node));
+    }
+
+    // same cut as collectTiles, clean subtrees are left out, nodes above
+    // the tiles are cleaned right away
+    private: static void collectDirtyTiles(const View &_view, const Rect &_roi, const Node _node, const bool _all,
+        std::vector<Tile> &_tiles)
+    {
+      if (!_all && !_view.dirty(_node))
+        return;
+
+      if (_roi.width*_roi.height <= tile_area)
+      {
+        _tiles.push_back({_node, _roi, false, 0.f});
+        return;
+      }
+
+      _view.clean(_node);
+
+      const Node left = _view.left(_node);
+      const Node right = _view.right(_node);
+
+      if (!_view.exists(left) && !_view.exists(right))
+      {
+        _tiles.push_back({_node, _roi, true, _view.value(_node)});
+        return;
+      }
+
+      Rect rect_left;
+      Rect rect_right;
+
+      std::tie(rect_left, rect_right) = splitRect(_roi);
+
+      // the value of a dirty node may have changed, so its gaps are redrawn
+      if (_view.exists(left))
+        collectDirtyTiles(_view, rect_left, left, _all, _tiles);
+      else
+        _tiles.push_back({_node, rect_left, true, _view.value(_node)});
+
+      if (_view.exists(right))
+        collectDirtyTiles(_view, rect_right, right, _all, _tiles);
+      else
+        _tiles.push_back({_node, rect_right, true, _view.value(_node)});
+    }
+
+    private: template <typename Target>
+    static void renderDirtyRecursive(const View &_view, Target &_dst, const Rect &_roi, const Node _node,
+        const bool _all) noexcept
+    {
+      if (!_all && !_view.dirty(_node))
+        return;
+
+      _view.clean(_node);
+
+      const auto value = PixelTraits<typename Target::Pixel>::fromValue(_view.value(_node));
+
+      const Node left = _view.left(_node);
+      const Node right = _view.right(_node);
+
+      if ((!_view.exists(left) && !_view.exists(right)) || (std::max(_roi.width,_roi.height) <= 1))
+      {
+        _dst.fillRect(_roi, value);
+
+        // what's finer than a pixel was drawn along, it has to be clean too
+        // for a later change below to dirty the path up to here
+        if (_view.exists(left))
+          cleanSubtree(_view, left);
+        if (_view.exists(right))
+          cleanSubtree(_view, right);
+        return;
+      }
+
+      Rect rect_left;
+      Rect rect_right;
+
+      std::tie(rect_left, rect_right) = splitRect(_roi);
+
+      if (_view.exists(left))
+        renderDirtyRecursive(_view, _dst, rect_left, left, _all);
+      else
+        _dst.fillRect(rect_left, value);
+
+      if (_view.exists(right))
+        renderDirtyRecursive(_view, _dst, rect_right, right, _all);
+      else
+        _dst.fillRect(rect_right, value);
+    }
+
+    /// Cleans the dirty nodes of a subtree, a clean node has none below it
+    private: static void cleanSubtree(const View &_view, const Node _node) noexcept
+    {
+      if (!_view.dirty(_node))
+        return;
+
+      _view.clean(_node);
+
+      const Node left = _view.left(_node);
+      const Node right = _view.right(_node);
+
+      if (_view.exists(left))
+        cleanSubtree(_view, left);
+      if (_view.exists(right))
+        cleanSubtree(_view, right);
+    }
+
+    private: template <typename Target>
+    static void renderRecursive(const View &_view, Target &_dst, const Rect &_roi, const Node _node) noexcept
+    {
+      const auto value = PixelTraits<typename Target::Pixel>::fromValue(_view.value(_node));
+
+      const Node left = _view.left(_node);
+      const Node right = _view.right(_node);
+
+      // nodes finer than a pixel are represented by their parent
+      if ((!_view.exists(left) && !_view.exists(right)) || (std::max(_roi.width,_roi.height) <= 1))
+      {
+        _dst.fillRect(_roi, value);
+        return;
+      }
+
+      Rect rect_left;
+      Rect rect_right;
+
+      std::tie(rect_left, rect_right) = splitRect(_roi);
+
+      if (_view.exists(left))
+        renderRecursive(_view, _dst, rect_left, left);
+      else
+        _dst.fillRect(rect_left, value);
+
+      if (_view.exists(right))
+        renderRecursive(_view, _dst, rect_right, right);
+      else
+        _dst.fillRect(rect_right, value);
+    }
+  };
+
+  /// How a chain carries the two children of a node
+  enum class FrameCoding : int
+  {
+    // both child values, FrameImageData
+    Pair = 0,
+    // their difference only, FrameDetailData, the lifted root value is in
+    // the sync
+    Detail = 1
+  };
+
+  enum class EncoderMode : int
+  {
+    // children averaged bottom-up, (l+r)/2 at every node
+    Recursive = 0,
+    // exact area-weighted averages taken from an IntegralImage
+    SummedArea = 1
+  };
+
+  class ImageBSP
+  {
+    private: float width = 1.0f;
+    private: float ratio = 1.0f;
+    private: ColorSpace color_mode;
+
+    private: const float empty_color = -1.f;
+
+    public: using ImageNode = BIVCodec::ImageNode;
+
+    // set when no allocator was given to the constructor
+    private: std::unique_ptr<NodeAllocator> own_allocator;
+    private: NodeAllocator *allocator = nullptr;
+
+    private: ImageNode *root_node = nullptr;
+
+    // the target of renderDirty doesn't hold a render of this tree yet
+    private: bool redraw_all = true;
+
+    // decoder side, frames of this layer and deeper don't build nodes
+    private: int layer_cutoff = FrameLocation::max_layer;
+
+    // applyFrameBatch scratch, kept so that a stream of batches doesn't allocate
+    // branches from the root in the top bits, layer in the low byte; the
+    // values ride along so that the sweep doesn't go back to the frames
+    private: struct BatchEntry
+    {
+      uint64_t key;
+      uint8_t value_l;    // the code of a detail frame
+      uint8_t value_r;
+      bool detail;
+    };
+
+    private: std::vector<BatchEntry> batch_entries;
+    private: std::vector<BatchEntry> batch_scratch;
+    // image frames below the cutoff, by their index in the batch
+    private: std::vector<size_t> batch_deep;
+    private: std::vector<ImageNode *> batch_path;
+
+    // repair scratch, the subtrees handed to the pool
+    private: std::vector<ImageNode *> repair_roots;
+
+    public: int frames = 0;
+
+    /// Nodes come from _allocator when given, it has to outlive the tree
+    public: explicit ImageBSP(const ColorSpace _mode, NodeAllocator *_allocator = nullptr):
+        color_mode(_mode)
+    {
+      this->initNodes(_allocator);
+    }
+
+    public: ImageBSP(ImageBSP &&) = default;
+    public: ImageBSP(const ImageBSP &) = delete;
+    public: ImageBSP &operator=(const ImageBSP &) = delete;
+
+    // 24bit path depth on the wire, frames are emitted for layers [0;24]
+    public: static constexpr int max_layers = 25;
+
+    public: template <typename T>
+    ImageBSP(const ImageMatrixT<T> &_src, const ColorSpace _mode):
+        ImageBSP(_src, _mode, EncoderMode::Recursive)
+    { }
+
+    /// _layers limits encoding to the top layers only, deeper details are dropped.
+    /// With a _pool the subtrees below the top layers are encoded concurrently,
+    /// the resulting tree is the same as the single-threaded one.
+    public: template <typename T>
+    ImageBSP(const ImageMatrixT<T> &_src, const ColorSpace _mode,
+        const EncoderMode _encoder, const int _layers = max_layers, ThreadPool *_pool = nullptr,
+        NodeAllocator *_allocator = nullptr)
+    {
+      this->initNodes(_allocator);
+
+      assert(_src.width >= 2);
+      assert(_src.height >= 1);
+      assert((_layers > 0) && (_layers <= max_layers));
+
+      this->width = _src.width;
+      this->ratio = static_cast<float>(_src.height)/_src.width;
+      this->color_mode = ColorSpace::Grayscale;
+
+      std::unique_ptr<IntegralImageT<T>> sat;
+      if (_encoder == EncoderMode::SummedArea)
+        sat.reset(new IntegralImageT<T>(_src));
+
+      const Rect roi(0, 0, _src.width, _src.height);
+
+      if (_pool)
+        this->encodeParallel(_src, sat.get(), roi, _layers, *_pool);
+      else
+        this->encodeNodeRecursive(_src, sat.get(), roi, this->root_node, *this->allocator, _layers, this->frames);
+    }
+
+    private: void initNodes(NodeAllocator *_allocator)
+    {
+      if (!_allocator)
+      {
+        this->own_allocator.reset(new ArenaNodeAllocator());
+        _allocator = this->own_allocator.get();
+      }
+
+      this->allocator = _allocator;
+      this->root_node = this->allocator->create(this->empty_color, 0);
+    }
+
+    /// Frame of a single node, doesn't depend on any other node
+    public: template <typename T>
+    static FrameImageData encodeNode(const IntegralImageT<T> &_sat, const Rect &_roi, const FrameLocation &_location)
+    {
+      assert(std::max(_roi.width,_roi.height) > 1);
+
+      FrameImageData fdata;
+      fdata.location = _location;
+
+      Rect rect_left;
+      Rect rect_right;
+
+      std::tie(rect_left, rect_right) = splitRect(_roi);
+
+      fdata.channel = 0;
+      fdata.value_l = FrameImageData::quantize(_sat.getAverageValue(rect_left));
+      fdata.value_r = FrameImageData::quantize(_sat.getAverageValue(rect_right));
+
+      return fdata;
+    }
+
+    protected: static inline bool isEncoderLeaf(const Rect &_roi, const int _layer, const int _layers) noexcept
     {
       // limit number of layers, (24bit path depth - 4k resolution max)
-      if ((std::max(_roi.width,_roi.height) <= 1) || (_path.size() > 24))
+      return (std::max(_roi.width,_roi.height) <= 1) || (_layer >= _layers);
+    }
+
+    protected: template <typename T>
+    static inline float sourceValue(const ImageMatrixT<T> &_src, const IntegralImageT<T> *_sat, const Rect &_roi)
+    {
+      return _sat ? _sat->getAverageValue(_roi) : _src.getAverageValue(_roi);
+    }
+
+    protected: ImageNode *createChild(ImageNode *_node, NodeAllocator &_nodes, const float _value) const
+    {
+      ImageNode *child = _nodes.create(_value, _node->layer+1);
+      child->parent = _node;
+
+      return child;
+    }
+
+    protected: void createChildren(ImageNode *_node, NodeAllocator &_nodes) const
+    {
+      if (!_node->left)
+        _node->left = this->createChild(_node, _nodes, this->empty_color);
+      if (!_node->right)
+        _node->right = this->createChild(_node, _nodes, this->empty_color);
+    }
+
+    /// Builds the subtree of _node straight from the source without touching
+    /// anything above it, so disjoint subtrees may be built concurrently
+    protected: template <typename T>
+    float encodeNodeRecursive(const ImageMatrixT<T> &_src, const IntegralImageT<T> *_sat, const Rect &_roi,
+        ImageNode *_node, NodeAllocator &_nodes, const int _layers, int &_frames)
+    {
+      if (isEncoderLeaf(_roi, _node->layer, _layers))
+        return sourceValue(_src, _sat, _roi);
+
+      if (!_sat && isTileRoot(_roi, _node->layer, _layers))
+        return this->encodeTiles(_src, _roi, _node, _nodes, _frames);
+
+      Rect rect_left;
+      Rect rect_right;
+
+      std::tie(rect_left, rect_right) = splitRect(_roi);
+
+      this->createChildren(_node, _nodes);
+
+      float value_l = encodeNodeRecursive(_src, _sat, rect_left, _node->left, _nodes, _layers, _frames);
+      float value_r = encodeNodeRecursive(_src, _sat, rect_right, _node->right, _nodes, _layers, _frames);
+
+      _node->left->value = value_l;
+      _node->right->value = value_r;
+      _node->value = _sat ? _sat->getAverageValue(_roi) : (value_l+value_r)/2;
+
+      _frames++;
+
+      return _node->value;
+    }
+
+    /// 4x4 tiles, or 8x4 pairs of them, whose four bottom layers are all encoded
+    protected: static inline bool isTileRoot(const Rect &_roi, const int _layer, const int _layers) noexcept
+    {
+      return (_roi.height == 4) &&
+             (((_roi.width == 4) && (_layer+4 <= _layers)) ||
+              ((_roi.width == 8) && (_layer+5 <= _layers)));
+    }
+
+    protected: template <typename T>
+    float encodeTiles(const ImageMatrixT<T> &_src, const Rect &_roi,
+        ImageNode *_node, NodeAllocator &_nodes, int &_frames)
+    {
+      TileValues tiles[2];
+      const int count = _roi.width/4;
+
+      TileKernels::reduceTiles(_src.row(_roi.y)+_roi.x, _src.width, count, tiles);
+
+      if (count == 1)
+        this->buildTileNodes(_node, _nodes, tiles[0]);
+      else
+      {
+        // 8x4 splits horizontally right into the two tiles
+        this->createChildren(_node, _nodes);
+        this->buildTileNodes(_node->left, _nodes, tiles[0]);
+        this->buildTileNodes(_node->right, _nodes, tiles[1]);
+
+        _node->value = (tiles[0].value+tiles[1].value)/2;
+        _frames++;
+      }
+
+      _frames += 15*count;
+
+      return _node->value;
+    }
+
+    protected: void buildTileNodes(ImageNode *_node, NodeAllocator &_nodes, const TileValues &_tile)
+    {
+      _node->value = _tile.value;
+      this->createChildren(_node, _nodes);
+
+      for (int r = 0; r < 2; ++r)
+      {
+        ImageNode *half = r ? _node->right : _node->left;
+        half->value = _tile.halves[r];
+        this->createChildren(half, _nodes);
+
+        for (int c = 0; c < 2; ++c)
+        {
+          ImageNode *quad = c ? half->right : half->left;
+          quad->value = _tile.quads[r][c];
+          this->createChildren(quad, _nodes);
+
+          for (int k = 0; k < 2; ++k)
+          {
+            const int row = 2*r+k;
+
+            ImageNode *pair = k ? quad->right : quad->left;
+            pair->value = _tile.pairs[row][c];
+            this->createChildren(pair, _nodes);
+
+            pair->left->value = _tile.pixels[row][2*c];
+            pair->right->value = _tile.pixels[row][2*c+1];
+          }
+        }
+      }
+    }
+
+    private: struct EncodeTask
+    {
+      Rect roi;
+      ImageNode *node = nullptr;
+      // tasks allocate from their own shard, so no lock is shared
+      NodeAllocator *nodes = nullptr;
+      float value = 0.f;
+      int frames = 0;
+    };
+
+    protected: template <typename T>
+    void encodeParallel(const ImageMatrixT<T> &_src, const IntegralImageT<T> *_sat, const Rect &_roi,
+        const int _layers, ThreadPool &_pool)
+    {
+      // a few subtrees per worker, so that stealing can even out the load
+      int split_layer = 0;
+      while ((1u<<split_layer) < 4*_pool.size())
+        split_layer++;
+
+      std::vector<EncodeTask> tasks;
+      this->expandTopRecursive(_roi, this->root_node, _layers, split_layer, tasks);
+
+      for (size_t i = 0; i < tasks.size(); ++i)
+        tasks[i].nodes = &this->allocator->shard(i);
+
+      _pool.parallelFor(tasks.size(), [this, &_src, _sat, _layers, &tasks](const size_t _id)
+        {
+          auto &task = tasks[_id];
+          task.value = this->encodeNodeRecursive(_src, _sat, task.roi, task.node, *task.nodes, _layers, task.frames);
+        });
+
+      size_t cursor = 0;
+      this->foldTopRecursive(_src, _sat, _roi, this->root_node, _layers, split_layer, tasks, cursor);
+
+      for (const auto &task : tasks)
+        this->frames += task.frames;
+    }
+
+    protected: void expandTopRecursive(const Rect &_roi, ImageNode *_node,
+        const int _layers, const int _split_layer, std::vector<EncodeTask> &_tasks)
+    {
+      if (isEncoderLeaf(_roi, _node->layer, _layers))
+        return;
+
+      if (_node->layer == _split_layer)
+      {
+        EncodeTask task;
+        task.roi = _roi;
+        task.node = _node;
+        _tasks.push_back(std::move(task));
+        return;
+      }
+
+      Rect rect_left;
+      Rect rect_right;
+
+      std::tie(rect_left, rect_right) = splitRect(_roi);
+
+      this->createChildren(_node, *this->allocator);
+
+      expandTopRecursive(rect_left, _node->left, _layers, _split_layer, _tasks);
+      expandTopRecursive(rect_right, _node->right, _layers, _split_layer, _tasks);
+    }
+
+    /// Same arithmetic as encodeNodeRecursive, subtree values come from the tasks
+    protected: template <typename T>
+    float foldTopRecursive(const ImageMatrixT<T> &_src, const IntegralImageT<T> *_sat, const Rect &_roi,
+        ImageNode *_node, const int _layers, const int _split_layer,
+        const std::vector<EncodeTask> &_tasks, size_t &_cursor)
+    {
+      if (isEncoderLeaf(_roi, _node->layer, _layers))
+        return sourceValue(_src, _sat, _roi);
+
+      if (_node->layer == _split_layer)
+        return _tasks[_cursor++].value;
+
+      Rect rect_left;
+      Rect rect_right;
+
+      std::tie(rect_left, rect_right) = splitRect(_roi);
+
+      float value_l = foldTopRecursive(_src, _sat, rect_left, _node->left, _layers, _split_layer, _tasks, _cursor);
+      float value_r = foldTopRecursive(_src, _sat, rect_right, _node->right, _layers, _split_layer, _tasks, _cursor);
+
+      _node->left->value = value_l;
+      _node->right->value = value_r;
+      _node->value = _sat ? _sat->getAverageValue(_roi) : (value_l+value_r)/2;
+
+      this->frames++;
+
+      return _node->value;
+    }
+
+    public: template <typename T = float>
+    ImageMatrixT<T> asImageMatrix(const int _width, ThreadPool *_pool = nullptr) const
+    {
+      int _height = _width*this->ratio;
+      ImageMatrixT<T> image(_width, _height, ColorSpace::Grayscale);
+
+      BSPRasterizer<NodeView>::render(NodeView{this->root_node}, image, _pool);
+
+      return std::move(image);
+    }
+
+    /// Renders the whole image scaled to the target, no intermediate buffers
+    public: void render(RenderTarget &_dst, ThreadPool *_pool = nullptr) const
+    {
+      BSPRasterizer<NodeView>::render(NodeView{this->root_node}, _dst, _pool);
+    }
+
+    /// Renders into all _count targets in a single pass over the tree
+    public: void render(RenderTarget *_levels, const int _count, ThreadPool *_pool = nullptr) const
+    {
+      BSPRasterizer<NodeView>::renderLevels(NodeView{this->root_node}, _levels, _count, _pool);
+    }
+
+    /// asImageMatrix at _width, _width/2, _width/4... for _count levels
+    public: template <typename T = float>
+    std::vector<ImageMatrixT<T>> asImagePyramid(const int _width, const int _count, ThreadPool *_pool = nullptr) const
+    {
+      std::vector<ImageMatrixT<T>> levels;
+      levels.reserve(_count);
+
+      for (int k = 0; k < _count; ++k)
       {
-        return _src.getAverageValue(_roi);
+        const int width = std::max(_width>>k, 1);
+        levels.emplace_back(width, static_cast<int>(width*this->ratio), ColorSpace::Grayscale);
       }
 
-      FrameImageData fdata;
-      fdata.location.path = _path;
-      fdata.location.layer = _path.size();
-      fdata.location.location_id = -1;                    // use unique counter
+      BSPRasterizer<NodeView>::renderLevels(NodeView{this->root_node}, levels.data(), _count, _pool);
+
+      return std::move(levels);
+    }
+
+    /// Renders _viewport, in source pixels, scaled to the whole target
+    public: void render(RenderTarget &_dst, const Rect &_viewport, ThreadPool *_pool = nullptr) const
+    {
+      BSPRasterizer<NodeView>::render(NodeView{this->root_node}, _dst, this->sourceRect(), _viewport, _pool);
+    }
+
+    /// Updates a persistent target with what changed since the last call,
+    /// returns the bounds of the redrawn area. _dst keeps its size between
+    /// calls, otherwise invalidate() first.
+    public: template <typename Target>
+    Rect renderDirty(Target &_dst, ThreadPool *_pool = nullptr)
+    {
+      Rect changed = BSPRasterizer<DirtyNodeView>::renderDirty(DirtyNodeView{this->root_node}, _dst,
+          this->redraw_all, _pool);
+      this->redraw_all = false;
+
+      return changed;
+    }
+
+    /// Next renderDirty redraws everything
+    public: void invalidate() noexcept
+    {
+      this->redraw_all = true;
+    }
+
+    public: template <typename T = float>
+    ImageMatrixT<T> asImageMatrix(const Rect &_viewport, const int _width, const int _height,
+        ThreadPool *_pool = nullptr) const
+    {
+      ImageMatrixT<T> image(_width, _height, ColorSpace::Grayscale);
 
-      Rect rect_left;
-      Rect rect_right;
+      BSPRasterizer<NodeView>::render(NodeView{this->root_node}, image, this->sourceRect(), _viewport, _pool);
 
-      std::tie(rect_left, rect_right) = splitRect(_roi);
+      return std::move(image);
+    }
 
-      fdata.channel = 0;
+    /// Frame of the encoded image, in its own pixels
+    public: Rect sourceRect() const noexcept
+    {
+      return Rect(0, 0, static_cast<int>(this->width), static_cast<int>(std::lround(this->width*this->ratio)));
+    }
+
+    protected: struct NodeView
+    {
+      using Node = const ImageNode *;
 
-      auto path_left = _path;
-      auto path_right = _path;
+      const ImageNode *root_node;
+
+      Node root() const noexcept { return this->root_node; }
+      Node left(const Node _node) const noexcept { return _node->left; }
+      Node right(const Node _node) const noexcept { return _node->right; }
+      float value(const Node _node) const noexcept { return _node->value; }
+      bool exists(const Node _node) const noexcept { return _node != nullptr; }
+    };
+
+    protected: struct DirtyNodeView
+    {
+      using Node = ImageNode *;
 
-      path_left.push_back(0);
-      path_right.push_back(1);
+      ImageNode *root_node;
 
-      // thread it?
-      fdata.value_l = applyFrameFromMatrixRecursive(_src, rect_left, path_left);
-      fdata.value_r = applyFrameFromMatrixRecursive(_src, rect_right, path_right);
+      Node root() const noexcept { return this->root_node; }
+      Node left(const Node _node) const noexcept { return _node->left; }
+      Node right(const Node _node) const noexcept { return _node->right; }
+      float value(const Node _node) const noexcept { return _node->value; }
+      bool exists(const Node _node) const noexcept { return _node != nullptr; }
+      bool dirty(const Node _node) const noexcept { return _node->dirty; }
+      void clean(const Node _node) const noexcept { _node->dirty = false; }
+    };
 
-      applyFrameData(fdata);
+    /// Number of layers a _width x _height display can resolve, nodes below
+    /// are finer than an output pixel
+    public: static int displayLayers(const int _width, const int _height) noexcept
+    {
+      auto log2_ceil = [](const int _size)
+        {
+          int bits = 0;
+          while ((1<<bits) < _size)
+            bits++;
+          return bits;
+        };
 
-      return (fdata.value_l+fdata.value_r)/2;
+      return log2_ceil(_width)+log2_ceil(_height);
     }
 
-    public: ImageMatrix asImageMatrix(const int _width) const noexcept
+    /// Frames of layer _layers and deeper are dropped on arrival, see
+    /// foldDeepFrame. Set it before applying frames, nodes already built
+    /// are kept.
+    public: void setLayerCutoff(const int _layers) noexcept
     {
-      int _height = _width*this->ratio;
-      ImageMatrix image(_width, _height, ColorSpace::Grayscale);
+      assert(_layers > 0);
 
-      applyNodeToMatrixRecursive(image, Rect(0, 0, _width, _height), this->root_node);
+      this->layer_cutoff = std::min(_layers, FrameLocation::max_layer);
+    }
 
-      return std::move(image);
+    public: void setDisplaySize(const int _width, const int _height) noexcept
+    {
+      this->setLayerCutoff(displayLayers(_width, _height));
     }
 
-    protected: void applyNodeToMatrixRecursive(ImageMatrix &_dst, const Rect &_roi, std::shared_ptr<ImageNode> _node) const noexcept
+    /// THREAD UNSAFE, returns nullptr when the frame is below the cutoff
+    public: ImageNode *applyFrameData(const FrameImageData &_modifier) noexcept
     {
-      if((!_node->left) && (!_node->right))
+      if (_modifier.location.layer >= this->layer_cutoff)
       {
-        _dst.fillRect(_roi, _node->value);
-        return;
+        this->foldDeepFrame(_modifier.location, (static_cast<float>(_modifier.value_l)+_modifier.value_r)/2);
+        return nullptr;
       }
 
-      if (std::max(_roi.width,_roi.height) <= 1)
-        return;
-
-      Rect rect_left;
-      Rect rect_right;
+      ImageNode *curr_node = this->root_node;
 
-      std::tie(rect_left, rect_right) = splitRect(_roi);
+      while (_modifier.location.layer != curr_node->layer)
+        curr_node = this->descend(curr_node, _modifier.location);
 
-      if (_node->left)
-        applyNodeToMatrixRecursive(_dst, rect_left, _node->left);
-      else
-        _dst.fillRect(rect_left, _node->value);
+      this->setNodeData(curr_node, _modifier);
 
-      if (_node->right)
-        applyNodeToMatrixRecursive(_dst, rect_right, _node->right);
-      else
-        _dst.fillRect(rect_right, _node->value);
+      return curr_node;
     }
 
-    /// THREAD UNSAFE
-    public: std::weak_ptr<ImageNode> applyFrameData(const FrameImageData &_modifier) noexcept
+    /// THREAD UNSAFE, returns nullptr when the frame is below the cutoff, or
+    /// the node otherwise. Deep detail frames are dropped, the estimate of
+    /// the node above them stands in for their subtree.
+    public: ImageNode *applyFrameData(const FrameDetailData &_modifier) noexcept
     {
-      auto curr_node = this->root_node;
+      if (_modifier.location.layer >= this->layer_cutoff)
+        return nullptr;
+
+      ImageNode *curr_node = this->root_node;
 
       while (_modifier.location.layer != curr_node->layer)
+        curr_node = this->descend(curr_node, _modifier.location);
+
+      this->setNodeDetail(curr_node, _modifier.detail);
+
+      return curr_node;
+    }
+
+    /// Child of _node towards _location, created if missing. _node is on the
+    /// way to a changed node, so it's marked dirty
+    protected: ImageNode *descend(ImageNode *_node, const FrameLocation &_location) noexcept
+    {
+      ImageNode *&next = _location.Path(_node->layer) ? _node->right : _node->left;
+
+      if (!next)
+        next = this->createChild(_node, *this->allocator, this->empty_color);
+
+      _node->dirty = true;
+
+      return next;
+    }
+
+    protected: void setNodeData(ImageNode *_node, const FrameImageData &_modifier) noexcept
+    {
+      this->createChildren(_node, *this->allocator);
+
+      _node->dirty = true;
+      _node->left->dirty = true;
+      _node->right->dirty = true;
+
+      _node->left->value = _modifier.value_l;
+      _node->right->value = _modifier.value_r;
+
+      _node->value = (static_cast<float>(_modifier.value_l)+_modifier.value_r)/2;
+
+      this->frames++;
+    }
+
+    protected: void setNodeDetail(ImageNode *_node, const FrameDetailData::Code _detail) noexcept
+    {
+      this->createChildren(_node, *this->allocator);
+
+      _node->dirty = true;
+      _node->detail = _detail;
+
+      // with the frames of its ancestors lost the node has no value yet, the
+      // closest ancestor that has one is spread down to it first
+      ImageNode *top = _node;
+      while (top && (top->value == this->empty_color))
+        top = top->parent;
+
+      if (top)
+        this->propagateDetail(top);
+
+      this->frames++;
+    }
+
+    /// Children of a detail coded node are lifted from its value, those of a
+    /// node whose frame is missing inherit its value
+    protected: float childValue(const ImageNode *_node, const int _side) const noexcept
+    {
+      if ((_node->value == this->empty_color) || (_node->detail == ImageNode::no_detail))
+        return _node->value;
+
+      return FrameDetailData::childValue(_node->value, _node->detail, _side);
+    }
+
+    /// Recomputes the values below _node, down to where nothing changes
+    /// anymore, changed nodes are marked dirty. _node's ancestors must be
+    /// dirty already
+    protected: void propagateDetail(ImageNode *_node) noexcept
+    {
+      ImageNode *stack[2*(FrameLocation::max_layer+2)];
+      int top = 0;
+
+      stack[top++] = _node;
+
+      while (top > 0)
       {
-        if (!_modifier.location.path[curr_node->layer])
-        {
-          if (!curr_node->left)
-          {
-            curr_node->left = std::make_shared<ImageNode>(this->empty_color, curr_node->layer+1);
-            curr_node->left->parent = curr_node;
-          }
+        ImageNode *node = stack[--top];
 
-          curr_node = curr_node->left;
-          continue;
-        }
-        else
+        for (int side = 0; side < 2; ++side)
         {
-          if (!curr_node->right)
-          {
-            curr_node->right = std::make_shared<ImageNode>(this->empty_color, curr_node->layer+1);
-            curr_node->right->parent = curr_node;
-          }
+          ImageNode *child = side ? node->right : node->left;
+          const float value = this->childValue(node, side);
 
-          curr_node = curr_node->right;
-          continue;
+          if (!child || (child->value == value))
+            continue;
+
+          child->value = value;
+          child->dirty = true;
+
+          stack[top++] = child;
         }
       }
+    }
 
-      // FIXME biolerplate code
-      if (!curr_node->left)
-      {
-        curr_node->left = std::make_shared<ImageNode>(this->empty_color, curr_node->layer+1);
-        curr_node->left->parent = curr_node;
-      }
-      if (!curr_node->right)
+    /// A frame below the cutoff doesn't create nodes. Its mean only stands
+    /// in for the deepest existing node above it, if that one has no value
+    /// of its own yet.
+    protected: void foldDeepFrame(const FrameLocation &_location, const float _value) noexcept
+    {
+      ImageNode *node = this->root_node;
+
+      while (node->layer < this->layer_cutoff)
       {
-        curr_node->right = std::make_shared<ImageNode>(this->empty_color, curr_node->layer+1);
-        curr_node->right->parent = curr_node;
+        ImageNode *next = _location.Path(node->layer) ? node->right : node->left;
+
+        if (!next)
+          break;
+
+        node = next;
       }
 
-      curr_node->left->value = _modifier.value_l;
-      curr_node->right->value = _modifier.value_r;
+      this->foldValue(node, _value);
+    }
 
-      curr_node->value = (_modifier.value_l+_modifier.value_r)/2;
+    protected: void foldValue(ImageNode *_node, const float _value) noexcept
+    {
+      if (_node->value != this->empty_color)
+        return;
 
-      this->frames++;
+      _node->value = _value;
 
-      return curr_node;
+      // a dirty node's ancestors are all dirty
+      for (ImageNode *id = _node; id && !id->dirty; id = id->parent)
+        id->dirty = true;
     }
 
     public: void applyFrameData(const FrameSyncData &_modifier) noexcept
     {
+      if ((this->width != _modifier.width) || (this->ratio != _modifier.ratio))
+        this->invalidate();
+
       this->width = _modifier.width;
       this->ratio = _modifier.ratio;
       this->color_mode = _modifier.color_format;
+
+      if ((_modifier.mean >= 0) && (this->root_node->value != _modifier.mean))
+      {
+        this->root_node->value = _modifier.mean;
+        this->root_node->dirty = true;
+
+        this->propagateDetail(this->root_node);
+      }
     }
 
-    public: std::vector<Frame> asFrameChain() noexcept
+    /// Pulls the frames of asFrameChain one at a time, in the same order.
+    /// Only the layer being emitted is held, as node pointers left to right
+    /// for LayerPermutation to pick from. A layer is gathered once the
+    /// previous one is used up, so a sender can put the coarse layers on
+    /// the wire before the deep ones are looked at. Detail coding also
+    /// holds the lifted value of every node, see FrameDetailData, and picks
+    /// each code against the value the decoder will have.
+    /// The tree must not change while the chain is being read.
+    public: class FrameChainGenerator
     {
-      std::vector<Frame> frame_chain;
-      std::map<int,std::vector<Frame>> layers;
+      private: struct LayerNode
+      {
+        const ImageNode *node;
+        FrameLocation location;
+        FrameDetailData::Code code;
+      };
 
-      Frame frame;
+      private: struct Lifted
+      {
+        int16_t value;
+        // nodes in the subtree, the node included
+        uint32_t size;
+      };
+
+      private: const ImageBSP *image;
+      private: FrameCoding coding;
+      private: FrameSyncData sync_data;
+
+      // next frame is the sync one until it has been taken
+      private: bool sync_pending = true;
+      private: bool finished = false;
 
-      frame.header.type = FrameHeader::HeaderType::Sync;
+      private: int layer = -1;
+      private: std::vector<LayerNode> layer_nodes;
+      private: LayerPermutation permutation {1, 0};
+      private: size_t cursor = 0;
 
-      auto sync_data = std::make_shared<FrameSyncData>();
-      frame.data = std::static_pointer_cast<FrameData>(sync_data);
+      // detail coding only, every framed node and its children in preorder
+      private: std::vector<Lifted> lifted;
 
-      sync_data->width = this->width;
-      sync_data->ratio = this->ratio;
+      public: explicit FrameChainGenerator(const ImageBSP &_image, const FrameCoding _coding = FrameCoding::Pair):
+          image(&_image), coding(_coding)
+      {
+        this->sync_data.width = _image.width;
+        this->sync_data.ratio = _image.ratio;
 
-      sync_data->color_format = this->color_mode;
-      sync_data->id = -1;
+        this->sync_data.color_format = _image.color_mode;
+        this->sync_data.id = -1;
 
-      sync_data->timestamp = static_cast<uint32_t>(std::time(nullptr));
+        if (_coding == FrameCoding::Detail)
+          this->sync_data.mean = this->liftRecursive(_image.root_node);
 
-      frame_chain.push_back(frame);
+        this->sync_data.timestamp = static_cast<uint32_t>(std::time(nullptr));
+      }
 
-      std::function<void(std::shared_ptr<ImageNode>,  std::vector<bool>)> pushNodeRecursive;
-      pushNodeRecursive = [&layers, &frame, &pushNodeRecursive](std::shared_ptr<ImageNode> _node, std::vector<bool> _path)
+      /// Returns false once the chain is exhausted
+      public: bool next(Frame &_frame)
       {
-        if ((!_node->left) || (!_node->right))
-          return;
+        if (this->sync_pending)
+        {
+          this->sync_pending = false;
+          _frame = Frame(this->sync_data);
+          return true;
+        }
+
+        while (this->cursor == this->layer_nodes.size())
+        {
+          if (this->finished)
+            return false;
 
-        auto image_data = std::make_shared<FrameImageData>();
-        frame.data = std::static_pointer_cast<FrameData>(image_data);
+          this->gatherLayer();
+        }
+
+        const LayerNode &entry = this->layer_nodes[this->permutation(this->cursor++)];
+
+        if (this->coding == FrameCoding::Detail)
+        {
+          FrameDetailData detail_data;
+
+          detail_data.location = entry.location;
+          detail_data.channel = 0;
+          detail_data.detail = entry.code;
+
+          _frame = Frame(detail_data);
+          return true;
+        }
+
+        FrameImageData image_data;
 
-        image_data->location.layer = _path.size();
-        image_data->location.path = _path;
-        image_data->location.location_id = -1;         // TODO unique id
+        image_data.location = entry.location;
+        image_data.channel = 0;
 
-        image_data->channel = 0;
+        image_data.value_l = FrameImageData::quantize(entry.node->left->value);
+        image_data.value_r = FrameImageData::quantize(entry.node->right->value);
 
-        image_data->value_l = _node->left ? _node->left->value : _node->value;
-        image_data->value_r = _node->right ? _node->right->value : _node->value;
+        _frame = Frame(image_data);
+        return true;
+      }
+
+      /// Pulls up to _capacity frames, returns how many were written
+      public: size_t next(Frame *_dst, const size_t _capacity)
+      {
+        size_t count = 0;
+
+        while ((count < _capacity) && this->next(_dst[count]))
+          count++;
 
-        layers[_node->layer].push_back(frame);
+        return count;
+      }
+
+      private: void gatherLayer()
+      {
+        this->layer++;
+        this->layer_nodes.clear();
+        this->cursor = 0;
 
+        this->gatherRecursive(this->image->root_node, FrameLocation(), 0, this->sync_data.mean);
 
-        if (_node->left)
+        // framed nodes have framed parents, an empty layer ends the chain
+        if (this->layer_nodes.empty())
         {
-          auto new_path = _path;
-          new_path.push_back(0);
-          pushNodeRecursive(_node->left, std::move(new_path));
+          this->finished = true;
+          return;
         }
 
-        if (_node->right)
+        this->permutation = LayerPermutation(this->layer_nodes.size(), this->layer);
+      }
+
+      /// _id is the node's entry in lifted and _value what the decoder
+      /// rebuilds it to, both only used by detail coding
+      private: void gatherRecursive(const ImageNode *_node, const FrameLocation _location,
+          const size_t _id, const float _value)
+      {
+        if ((!_node->left) || (!_node->right))
+          return;
+
+        const size_t left = _id+1;
+        size_t right = left;
+        FrameDetailData::Code code = 0;
+
+        if (this->coding == FrameCoding::Detail)
         {
-          auto new_path = _path;
-          new_path.push_back(1);
-          pushNodeRecursive(_node->right, std::move(new_path));
+          right = left+this->lifted[left].size;
+          code = FrameDetailData::quantize(_value, this->lifted[left].value, this->lifted[right].value);
         }
-      };
 
-      frame.header.type = FrameHeader::HeaderType::Image;
+        if (_node->layer == this->layer)
+        {
+          this->layer_nodes.push_back({_node, _location, code});
+          return;
+        }
 
-      pushNodeRecursive(this->root_node, std::vector<bool>());
+        this->gatherRecursive(_node->left, _location.child(0), left, FrameDetailData::childValue(_value, code, 0));
+        this->gatherRecursive(_node->right, _location.child(1), right, FrameDetailData::childValue(_value, code, 1));
+      }
 
-      for (auto layer : layers)
+      /// Appends the subtree of _node to lifted, returns its lifted value
+      private: int liftRecursive(const ImageNode *_node)
       {
-        /// TODO integrate one layer into another
+        const size_t id = this->lifted.size();
+        this->lifted.push_back({0, 1});
 
-        // use deterministic permutations
-        std::mt19937 re(0);
+        int value;
+
+        if (_node->left && _node->right)
+        {
+          const int left = this->liftRecursive(_node->left);
+          const int right = this->liftRecursive(_node->right);
+
+          value = FrameDetailData::liftValue(left, right);
+        }
+        else
+          value = FrameSyncData::quantizeMean(_node->value);
 
-        std::shuffle(layer.second.begin(), layer.second.end(), re);
+        this->lifted[id] = {static_cast<int16_t>(value), static_cast<uint32_t>(this->lifted.size()-id)};
 
-        frame_chain.insert(frame_chain.end(), layer.second.begin(), layer.second.end());
+        return value;
       }
+    };
+
+    public: FrameChainGenerator frameChain(const FrameCoding _coding = FrameCoding::Pair) const
+    {
+      return FrameChainGenerator(*this, _coding);
+    }
+
+    public: std::vector<Frame> asFrameChain(const FrameCoding _coding = FrameCoding::Pair) noexcept
+    {
+      std::vector<Frame> frame_chain;
+
+      FrameChainGenerator chain(*this, _coding);
+
+      Frame frame;
+      while (chain.next(frame))
+        frame_chain.push_back(frame);
 
       return std::move(frame_chain);
     }
 
     public: void applyFrameChain(const std::vector<Frame> &_frames) noexcept
     {
-      for (auto frame : _frames)
+      if (!_frames.empty())
+        this->applyFrameBatch(&_frames[0], _frames.size());
+    }
+
+    /// Applies a span of received frames, e.g. a socket backlog, in tree
+    /// preorder instead of arrival order. Image and detail frames are radix
+    /// sorted by (branches from the root, layer) and applied in one sweep,
+    /// each frame only walks down from where its path leaves the previous
+    /// one's. Sync frames go in first, in order. Image frames below the
+    /// cutoff are folded after the sweep, in arrival order, so that they find
+    /// the nodes their ancestors' frames created. The end state is that of
+    /// applying the frames one by one whenever every frame comes after those
+    /// of its ancestors, as chains are sent; repeated frames keep their
+    /// arrival order. THREAD UNSAFE
+    public: void applyFrameBatch(const Frame *_frames, const size_t _count)
+    {
+      this->batch_entries.clear();
+      this->batch_deep.clear();
+
+      for (size_t i = 0; i < _count; ++i)
+      {
+        if (_frames[i].isImage())
+        {
+          const FrameImageData &image = _frames[i].image;
+
+          if (image.location.layer >= this->layer_cutoff)
+            this->batch_deep.push_back(i);
+          else
+            this->batch_entries.push_back({reverseBits(image.location.fuse())|image.location.layer,
+                                           image.value_l, image.value_r, false});
+        }
+        else if (_frames[i].isDetail())
+        {
+          const FrameDetailData &detail = _frames[i].detail;
+          this->batch_entries.push_back({reverseBits(detail.location.fuse())|detail.location.layer,
+                                         static_cast<uint8_t>(detail.detail), 0, true});
+        }
+        else
+          this->applyFrameData(_frames[i].sync);
+      }
+
+      this->sortBatch();
+
+      // nodes from the root down along the previous frame's path
+      this->batch_path.resize(FrameLocation::max_layer+1);
+      this->batch_path[0] = this->root_node;
+
+      int depth = 0;
+      uint64_t branches = 0;
+
+      for (const auto &entry : this->batch_entries)
       {
-        if (frame.header.type == FrameHeader::HeaderType::Image)
-          applyFrameData(*std::static_pointer_cast<FrameImageData>(frame.data));
+        FrameImageData modifier;
+        modifier.location.defuse(reverseBits(entry.key&~uint64_t(0xff)), entry.key&0xff);
+        modifier.value_l = entry.value_l;
+        modifier.value_r = entry.value_r;
+
+        const int layer = modifier.location.layer;
+
+        // deep detail frames are dropped, see applyFrameData
+        if (entry.detail && (layer >= this->layer_cutoff))
+          continue;
+
+        // node at depth d only depends on the first d branches
+        const uint64_t diverged = branches^(entry.key&~uint64_t(0xff));
+        int d = std::min(std::min(depth, diverged ? __builtin_clzll(diverged) : 64), layer);
+
+        for (; d < layer; ++d)
+          this->batch_path[d+1] = this->descend(this->batch_path[d], modifier.location);
+
+        if (entry.detail)
+          this->setNodeDetail(this->batch_path[layer], static_cast<FrameDetailData::Code>(entry.value_l));
         else
-          applyFrameData(*std::static_pointer_cast<FrameSyncData>(frame.data));
+          this->setNodeData(this->batch_path[layer], modifier);
+
+        depth = d;
+        branches = entry.key&~uint64_t(0xff);
+      }
+
+      // a deep frame folds into the deepest node on its path, which a frame
+      // later in the sweep may still create
+      for (const size_t i : this->batch_deep)
+      {
+        const FrameImageData &image = _frames[i].image;
+        this->foldDeepFrame(image.location, (static_cast<float>(image.value_l)+image.value_r)/2);
+      }
+    }
+
+    /// Stable LSD radix sort of batch_entries, bytes every key shares are
+    /// skipped, for wire paths that leaves four passes
+    private: void sortBatch()
+    {
+      const size_t count = this->batch_entries.size();
+
+      if (count < 2)
+        return;
+
+      size_t histogram[8][256] = {};
+
+      for (const auto &entry : this->batch_entries)
+        for (int b = 0; b < 8; ++b)
+          histogram[b][(entry.key>>(8*b))&0xff]++;
+
+      this->batch_scratch.resize(count);
+
+      for (int b = 0; b < 8; ++b)
+      {
+        auto &counts = histogram[b];
+
+        if (counts[(this->batch_entries[0].key>>(8*b))&0xff] == count)
+          continue;
+
+        size_t offset = 0;
+        for (auto &bucket : counts)
+        {
+          const size_t size = bucket;
+          bucket = offset;
+          offset += size;
+        }
+
+        for (const auto &entry : this->batch_entries)
+          this->batch_scratch[counts[(entry.key>>(8*b))&0xff]++] = entry;
+
+        std::swap(this->batch_entries, this->batch_scratch);
       }
     }
 
-    public: void repair()
+    // bit i goes to bit 63-i, the branch at layer 0 becomes the top bit
+    private: static inline uint64_t reverseBits(uint64_t _x) noexcept
     {
-      this->repairNodeValueRecursive(this->root_node);
+      _x = ((_x>>1)&0x5555555555555555ull)|((_x&0x5555555555555555ull)<<1);
+      _x = ((_x>>2)&0x3333333333333333ull)|((_x&0x3333333333333333ull)<<2);
+      _x = ((_x>>4)&0x0f0f0f0f0f0f0f0full)|((_x&0x0f0f0f0f0f0f0f0full)<<4);
+
+      return __builtin_bswap64(_x);
     }
 
-    protected: float repairNodeValueRecursive(std::shared_ptr<ImageNode> _node) noexcept
+    public: void repair(ThreadPool *_pool = nullptr)
     {
-      if (_node->left && _node->right)
+      this->repairTree(false, _pool);
+    }
+
+    /// repair() limited to subtrees changed since the last renderDirty, the
+    /// rest was repaired before it was drawn
+    public: void repairDirty(ThreadPool *_pool = nullptr)
+    {
+      this->repairTree(true, _pool);
+    }
+
+    /// Post-order on an explicit stack, one entry per layer. With a pool
+    /// the subtrees below a few top layers are repaired concurrently, each
+    /// allocating the siblings it synthesizes from its own shard, the top
+    /// layers follow once they're done.
+    protected: void repairTree(const bool _dirty_only, ThreadPool *_pool)
+    {
+      if (!_pool)
       {
-        _node->value = (repairNodeValueRecursive(_node->left)+repairNodeValueRecursive(_node->right))/2;
+        this->repairSubtree(this->root_node, _dirty_only, FrameLocation::max_layer+1, *this->allocator);
+        return;
       }
-      else
+
+      int split_layer = 0;
+      while ((1u<<split_layer) < 4*_pool->size())
+        split_layer++;
+
+      auto &roots = this->repair_roots;
+      roots.clear();
+
+      // eligible nodes of the split layer, reached through eligible ones
+      if (isRepaired(this->root_node, _dirty_only))
+        roots.push_back(this->root_node);
+
+      for (int l = 0; l < split_layer; ++l)
       {
-        if (_node->left)
+        const size_t count = roots.size();
+
+        for (size_t i = 0; i < count; ++i)
         {
-          float child_value = repairNodeValueRecursive(_node->left);
-          if (_node->value == this->empty_color)
-            _node->value = child_value;
-          else
-            _node->right = std::make_shared<ImageNode>(_node->value*2-child_value, _node->layer+1);
+          ImageNode *node = roots[i];
+
+          if (node->layer != l)
+            continue;
+
+          for (ImageNode *child : {node->left, node->right})
+            if (isRepaired(child, _dirty_only))
+              roots.push_back(child);
         }
-        else
+      }
+
+      // shards are created up front, handing them out isn't thread safe
+      if (!roots.empty())
+        this->allocator->shard(roots.size()-1);
+
+      _pool->parallelFor(roots.size(), [this, &roots, _dirty_only, split_layer](const size_t _id)
+        {
+          if (roots[_id]->layer == split_layer)
+            this->repairSubtree(roots[_id], _dirty_only, FrameLocation::max_layer+1, this->allocator->shard(_id));
+        });
+
+      this->repairSubtree(this->root_node, _dirty_only, split_layer, *this->allocator);
+    }
+
+    protected: static inline bool isRepaired(const ImageNode *_node, const bool _dirty_only) noexcept
+    {
+      return _node && (!_dirty_only || _node->dirty);
+    }
+
+    /// Repairs _root and whatever is below it above _stop_layer, nodes of
+    /// _stop_layer are taken as they are
+    protected: void repairSubtree(ImageNode *_root, const bool _dirty_only, const int _stop_layer,
+        NodeAllocator &_nodes) const noexcept
+    {
+      if (!isRepaired(_root, _dirty_only))
+        return;
+
+      // nodes on the way down, with the children still to be visited
+      struct Pending
+      {
+        ImageNode *node;
+        ImageNode *right;
+      };
+
+      Pending stack[FrameLocation::max_layer+2];
+      int top = 0;
+
+      ImageNode *node = _root;
+
+      while (true)
+      {
+        // down the left-most unrepaired path
+        while (node->layer+1 < _stop_layer)
+        {
+          ImageNode *left = isRepaired(node->left, _dirty_only) ? node->left : nullptr;
+          ImageNode *right = isRepaired(node->right, _dirty_only) ? node->right : nullptr;
+
+          if (!left && !right)
+            break;
+
+          stack[top++] = {node, left ? right : nullptr};
+          node = left ? left : right;
+        }
+
+        this->repairNode(node, _nodes);
+
+        // up until some right subtree is still pending
+        while (true)
         {
-          if (_node->right)
+          if (top == 0)
+            return;
+
+          Pending &pending = stack[top-1];
+
+          if (pending.right)
           {
-            float child_value = repairNodeValueRecursive(_node->right);
-            if (_node->value == this->empty_color)
-              _node->value = child_value;
-            else
-              _node->left = std::make_shared<ImageNode>(_node->value*2-child_value, _node->layer+1);
+            node = pending.right;
+            pending.right = nullptr;
+            break;
           }
+
+          this->repairNode(pending.node, _nodes);
+          top--;
         }
       }
+    }
+
+    protected: void repairNode(ImageNode *_node, NodeAllocator &_nodes) const noexcept
+    {
+      if (_node->left && _node->right)
+        _node->value = (_node->left->value+_node->right->value)/2;
+      else if (_node->left || _node->right)
+      {
+        ImageNode *&sibling = _node->left ? _node->right : _node->left;
+        const float child_value = _node->left ? _node->left->value : _node->right->value;
+
+        if (_node->value == this->empty_color)
+          _node->value = child_value;
+        else
+          sibling = this->createChild(_node, _nodes, _node->value*2-child_value);
+      }
 
-      return _node->value;
+      // a synthesized sibling is dirty, children are repaired first, so
+      // this carries it up to the root
+      if ((_node->left && _node->left->dirty) || (_node->right && _node->right->dirty))
+        _node->dirty = true;
     }
   };
 };
\ No newline at end of file
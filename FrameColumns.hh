@@ -0,0 +1,230 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+#include <algorithm>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "Frame.hh"
+
+
+namespace BIVCodec
+{
+  /// Received wire records split into structure-of-arrays form. Image
+  /// fields are filled for every record, they are meaningless where the
+  /// record is a sync one; sync records are decoded aside, in order. Detail
+  /// records keep their code in values_l.
+  /// Buffers are kept between calls, decoding same-sized batches does not
+  /// allocate. Pair coded runs are transposed 16 records at a time, detail
+  /// coded ones are taken one at a time, at their own stride.
+  class FrameColumns
+  {
+    public: std::vector<uint8_t> types;
+    public: std::vector<uint8_t> layers;
+    public: std::vector<uint32_t> paths;    // fused path as on the wire, 24 bit
+    public: std::vector<uint8_t> channels;
+    public: std::vector<uint8_t> values_l;
+    public: std::vector<uint8_t> values_r;
+
+    // record index of every sync frame, with its data
+    public: std::vector<size_t> sync_index;
+    public: std::vector<FrameSyncData> sync;
+
+    public: size_t count = 0;
+
+    public: size_t size() const noexcept
+    {
+      return this->count;
+    }
+
+    public: bool isImage(const size_t _id) const noexcept
+    {
+      return this->types[_id] == static_cast<uint8_t>(FrameHeader::HeaderType::Image);
+    }
+
+    public: bool isDetail(const size_t _id) const noexcept
+    {
+      return this->types[_id] == static_cast<uint8_t>(FrameHeader::HeaderType::Detail);
+    }
+
+    /// Decodes every whole record of _src, returns the number of records.
+    /// Records of unknown type are left out
+    public: size_t decode(const uint8_t *_src, const size_t _size)
+    {
+      this->resize(_size/Frame::detail_wire_size);
+      this->sync_index.clear();
+      this->sync.clear();
+
+      size_t i = 0;
+      size_t offset = 0;
+
+      // whether the records at offset may be a run of image ones
+      bool blocks = true;
+
+      while (offset < _size)
+      {
+#if defined(__SSE2__)
+        for (; blocks && (offset+16*Frame::wire_size <= _size); )
+        {
+          size_t block = 16;
+
+          // sync frames are rare, the block reports them as a bit mask
+          for (unsigned others = this->decodeBlockSSE(_src+offset, i); others; others &= others-1)
+          {
+            const size_t id = i+__builtin_ctz(others);
+
+            if (!isSyncType(this->types[id]))
+            {
+              // the block is misaligned from here on
+              block = id-i;
+              blocks = false;
+              break;
+            }
+
+            this->appendSync(_src+offset+(id-i)*Frame::wire_size, id);
+          }
+
+          i += block;
+          offset += block*Frame::wire_size;
+        }
+#endif
+
+        if (offset == _size)
+          break;
+
+        const uint8_t type = _src[offset];
+        const size_t size = Frame::recordSize(type);
+
+        if (offset+size > _size)
+          break;
+
+        if (isSyncType(type))
+          this->appendSync(_src+offset, i);
+
+        if ((type == static_cast<uint8_t>(FrameHeader::HeaderType::Image)) ||
+            (type == static_cast<uint8_t>(FrameHeader::HeaderType::Detail)) || isSyncType(type))
+          this->decodeRecord(_src+offset, size, i++);
+
+        // a detail coded run goes one record at a time
+        blocks = (type != static_cast<uint8_t>(FrameHeader::HeaderType::Detail));
+        offset += size;
+      }
+
+      this->resize(i);
+
+      return this->count;
+    }
+
+    private: static inline bool isSyncType(const uint8_t _type) noexcept
+    {
+      return (_type&~Frame::mean_flag) == static_cast<uint8_t>(FrameHeader::HeaderType::Sync);
+    }
+
+    private: void appendSync(const uint8_t *_record, const size_t _id)
+    {
+      Frame frame;
+      frame.deserialize(_record);
+
+      this->sync_index.push_back(_id);
+      this->sync.push_back(frame.sync);
+    }
+
+    private: void resize(const size_t _count)
+    {
+      this->types.resize(_count);
+      this->layers.resize(_count);
+      this->paths.resize(_count);
+      this->channels.resize(_count);
+      this->values_l.resize(_count);
+      this->values_r.resize(_count);
+
+      this->count = _count;
+    }
+
+    private: void decodeRecord(const uint8_t *_src, const size_t _size, const size_t _id) noexcept
+    {
+      this->types[_id] = _src[0];
+      this->layers[_id] = _src[1];
+      this->paths[_id] =
+          static_cast<uint32_t>(_src[2])|
+          static_cast<uint32_t>(_src[3])<<8|
+          static_cast<uint32_t>(_src[4])<<16;
+      this->channels[_id] = _src[5];
+      this->values_l[_id] = _src[6];
+      this->values_r[_id] = (_size == Frame::wire_size) ? _src[7] : 0;
+    }
+
+#if defined(__SSE2__)
+    /// Transposes 16 records, 16x8 bytes, into one 16 byte vector per field.
+    /// Returns a mask of the records that are not image frames, the ones
+    /// past the first that isn't a sync either are garbage
+    private: unsigned decodeBlockSSE(const uint8_t *_src, const size_t _id) noexcept
+    {
+      __m128i w[8];
+
+      // interleave the two records of every load, word k holds byte k of both
+      for (int j = 0; j < 8; ++j)
+      {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(_src+16*j));
+        w[j] = _mm_unpacklo_epi8(x, _mm_srli_si128(x, 8));
+      }
+
+      // 8x8 transpose of 16 bit words
+      __m128i t[8];
+      for (int j = 0; j < 4; ++j)
+      {
+        t[2*j] = _mm_unpacklo_epi16(w[2*j], w[2*j+1]);
+        t[2*j+1] = _mm_unpackhi_epi16(w[2*j], w[2*j+1]);
+      }
+
+      __m128i u[8];
+      for (int j = 0; j < 2; ++j)
+      {
+        u[4*j] = _mm_unpacklo_epi32(t[4*j], t[4*j+2]);
+        u[4*j+1] = _mm_unpackhi_epi32(t[4*j], t[4*j+2]);
+        u[4*j+2] = _mm_unpacklo_epi32(t[4*j+1], t[4*j+3]);
+        u[4*j+3] = _mm_unpackhi_epi32(t[4*j+1], t[4*j+3]);
+      }
+
+      __m128i field[8];
+      for (int j = 0; j < 4; ++j)
+      {
+        field[2*j] = _mm_unpacklo_epi64(u[j], u[j+4]);
+        field[2*j+1] = _mm_unpackhi_epi64(u[j], u[j+4]);
+      }
+
+      auto store = [_id](std::vector<uint8_t> &_column, const __m128i _v)
+        { _mm_storeu_si128(reinterpret_cast<__m128i *>(&_column[_id]), _v); };
+
+      store(this->types, field[0]);
+      store(this->layers, field[1]);
+      store(this->channels, field[5]);
+      store(this->values_l, field[6]);
+      store(this->values_r, field[7]);
+
+      // widen the three path bytes to 32 bit
+      const __m128i zero = _mm_setzero_si128();
+      const __m128i low[2] = {_mm_unpacklo_epi8(field[2], field[3]), _mm_unpackhi_epi8(field[2], field[3])};
+      const __m128i high[2] = {_mm_unpacklo_epi8(field[4], zero), _mm_unpackhi_epi8(field[4], zero)};
+
+      __m128i *paths = reinterpret_cast<__m128i *>(&this->paths[_id]);
+
+      for (int j = 0; j < 2; ++j)
+      {
+        _mm_storeu_si128(paths+2*j, _mm_unpacklo_epi16(low[j], high[j]));
+        _mm_storeu_si128(paths+2*j+1, _mm_unpackhi_epi16(low[j], high[j]));
+      }
+
+      const __m128i image = _mm_set1_epi8(static_cast<char>(FrameHeader::HeaderType::Image));
+
+      return ~_mm_movemask_epi8(_mm_cmpeq_epi8(field[0], image)) & 0xffff;
+    }
+#endif
+  };
+};
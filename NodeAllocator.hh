@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdint>
+
+#include <memory>
+#include <vector>
+
+
+namespace BIVCodec
+{
+  /// Tree node of ImageBSP. Trivially destructible, the links don't own
+  /// anything, nodes are owned by the NodeAllocator they came from.
+  class ImageNode
+  {
+    public: float value = 0.f;
+    public: int16_t layer = 0;
+    // changed since the last incremental render, new nodes haven't been drawn
+    public: bool dirty = true;
+    // Haar code of value_l-value_r when detail coded, fits in the padding
+    public: int8_t detail = no_detail;
+
+    public: static constexpr int8_t no_detail = -128;
+
+    public: ImageNode *parent = nullptr;
+
+    public: ImageNode *left = nullptr;
+    public: ImageNode *right = nullptr;
+
+    public: ImageNode() = default;
+
+    public: ImageNode(const float _value, const int _layer):
+        value(_value), layer(_layer)
+    { }
+  };
+
+  /// Source of ImageBSP nodes. Not thread safe, concurrent users take
+  /// separate shards, which live and get reset together with their parent.
+  class NodeAllocator
+  {
+    private: std::vector<std::unique_ptr<NodeAllocator>> shards;
+
+    public: virtual ~NodeAllocator() = default;
+
+    public: ImageNode *create(const float _value, const int _layer)
+    {
+      ImageNode *node = this->allocate();
+      *node = ImageNode(_value, _layer);
+
+      return node;
+    }
+
+    public: NodeAllocator &shard(const size_t _id)
+    {
+      while (this->shards.size() <= _id)
+        this->shards.push_back(this->spawn());
+
+      return *this->shards[_id];
+    }
+
+    /// Invalidates every node handed out by this allocator and its shards
+    public: void reset()
+    {
+      for (auto &shard : this->shards)
+        shard->reset();
+
+      this->resetStorage();
+    }
+
+    public: virtual ImageNode *allocate() = 0;
+
+    protected: virtual void resetStorage() = 0;
+
+    protected: virtual std::unique_ptr<NodeAllocator> spawn() const = 0;
+  };
+
+  /// Bump allocator, reset is O(1). Chunks are kept for reuse, so a tree of
+  /// the same size as the last one costs nothing. ImageBSP never drops a
+  /// node before the reset, a long-lived tree overwrites its nodes in place.
+  class ArenaNodeAllocator: public NodeAllocator
+  {
+    private: static constexpr size_t chunk_size = 4096;
+
+    private: std::vector<std::unique_ptr<ImageNode[]>> chunks;
+    // chunks handed out since the last reset, the last one is being filled
+    private: size_t used_chunks = 0;
+    private: size_t offset = chunk_size;
+
+    public: ImageNode *allocate() override
+    {
+      if (this->offset == chunk_size)
+      {
+        if (this->used_chunks == this->chunks.size())
+          this->chunks.emplace_back(new ImageNode[chunk_size]);
+
+        this->used_chunks++;
+        this->offset = 0;
+      }
+
+      return &this->chunks[this->used_chunks-1][this->offset++];
+    }
+
+    protected: void resetStorage() override
+    {
+      this->used_chunks = 0;
+      this->offset = chunk_size;
+    }
+
+    protected: std::unique_ptr<NodeAllocator> spawn() const override
+    {
+      return std::unique_ptr<NodeAllocator>(new ArenaNodeAllocator());
+    }
+  };
+};
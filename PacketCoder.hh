@@ -0,0 +1,623 @@
+#pragma once
+
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include <algorithm>
+#include <vector>
+
+#include "Frame.hh"
+
+
+namespace BIVCodec
+{
+  /// Optional entropy coding of a packet of wire records. rANS with static
+  /// models, nothing is carried from one packet to the next, so a packet
+  /// decodes on its own and losing it costs only its own frames.
+  /// Per record:
+  /// - type and layer as one symbol, coded as the change from the previous
+  ///   record of the packet, chains keep it the same for long runs; a flag
+  ///   in it marks a channel other than 0, which then follows raw
+  /// - the path, as the change of the gap to the previous record of the
+  ///   run, gaps taken left to right within the layer as Packetizer does;
+  ///   dealt records keep it 0 mostly. Changes too large for the model and
+  ///   the first records of a run escape to the path's raw bits; an escape
+  ///   makes the next one likely, records that aren't dealt escape in a row
+  /// - value_l raw and value_l-value_r, or the detail code, under a
+  ///   Laplacian model of the record's layer, deeper layers are flatter
+  /// Sync records go raw.
+  /// Each field of a record goes to one of two rANS lanes, fixed per field,
+  /// so that the decoder runs two independent dependency chains. A lane has
+  /// a 64 bit state that renormalizes by whole 32 bit words, at most one per
+  /// symbol, so it refills without branching on the data. Records are read
+  /// without bounds checks while both lanes have a record's worth of words
+  /// left.
+  /// A packet is the record count (2 bytes), the size of the first lane's
+  /// stream in words (2 bytes), a checksum of the decoded records (2 bytes),
+  /// the final lane states (8 bytes each) and the lane streams, all little
+  /// endian. rANS turns damage into plausible records rather than failing,
+  /// so the checksum is what rejects a damaged packet. It sums whole records
+  /// as they're decoded, not the bytes in a pass of its own.
+  class PacketCoder
+  {
+    private: static constexpr int lanes = 2;
+
+    public: static constexpr size_t header_size = 6+8*lanes;
+    public: static constexpr size_t max_records = 0xffff;
+
+    private: static constexpr int scale_bits = 12;
+    private: static constexpr uint32_t scale = 1u<<scale_bits;
+    private: static constexpr uint64_t rans_low = uint64_t(1)<<31;
+
+    // raw symbols are at most this wide, wider ones overflow the state
+    private: static constexpr int raw_bits = 31;
+
+    // kinds of record, image ones are the layer, detail ones the layer
+    // with detail_flag; the header symbol is the change of kind, mod 128,
+    // with channel_flag
+    private: static constexpr uint8_t sync_kind = 64;
+    private: static constexpr uint8_t detail_flag = 32;
+    private: static constexpr uint8_t kind_mask = 127;
+    private: static constexpr uint8_t channel_flag = 128;
+
+    // gap symbol that is followed by the raw path
+    private: static constexpr uint8_t escape = 255;
+
+    private: struct Model
+    {
+      uint16_t freq[256];
+      uint16_t start[256];
+      // decoder side, symbol | (slot-start)<<8 | freq<<20 of every slot
+      uint32_t slots[scale];
+    };
+
+    private: struct Models
+    {
+      Model header;
+      // after a modelled gap and after an escape
+      Model gap[2];
+      Model values[FrameLocation::wire_layers+1];
+    };
+
+    // records of one kind in a row, positions are left to right in the layer
+    private: struct Run
+    {
+      uint8_t kind = 0;
+      int32_t position = 0;
+      int32_t gap = 0;
+      bool escaped = false;
+    };
+
+    /// Fletcher sums over the records, a record a little endian word
+    private: struct Checksum
+    {
+      uint64_t a = 0;
+      uint64_t b = 0;
+
+      inline void add(const uint64_t _record) noexcept
+      {
+        this->a += _record;
+        this->b += this->a;
+      }
+
+      /// Both sums mixed and folded to 16 bits
+      inline uint16_t value() const noexcept
+      {
+        uint64_t sum = this->a^(this->b*0x9e3779b97f4a7c15ull);
+        sum ^= sum>>32;
+        sum ^= sum>>16;
+
+        return static_cast<uint16_t>(sum);
+      }
+
+      /// The _size bytes at _src as a record word
+      static inline uint64_t load(const uint8_t *_src, const int _size) noexcept
+      {
+        uint64_t record = 0;
+        for (int i = 0; i < _size; ++i)
+          record |= static_cast<uint64_t>(_src[i])<<(8*i);
+
+        return record;
+      }
+    };
+
+    private: struct Symbol
+    {
+      uint32_t start;
+      uint16_t freq;
+      uint8_t bits;
+      uint8_t lane;
+    };
+
+    private: struct Lane
+    {
+      uint64_t x;
+      const uint8_t *ptr;
+      const uint8_t *end;
+    };
+
+    // most words a lane refills with over one record, a sync one
+    private: static constexpr size_t record_words = 5;
+
+    private: struct Decoder
+    {
+      Lane lanes[PacketCoder::lanes];
+      // a word was needed past the end of a lane, the packet is damaged
+      bool overrun = false;
+
+      Run run;
+      Checksum sum;
+
+      /// Every lane has record_words left
+      inline bool roomy() const noexcept
+      {
+        return (static_cast<size_t>(this->lanes[0].end-this->lanes[0].ptr) >= 4*record_words) &&
+               (static_cast<size_t>(this->lanes[1].end-this->lanes[1].ptr) >= 4*record_words);
+      }
+
+      template <bool Checked>
+      inline uint8_t model(const int _lane, const Model &_model) noexcept
+      {
+        Lane &lane = this->lanes[_lane];
+
+        const uint32_t slot = _model.slots[lane.x&(scale-1)];
+        lane.x = (slot>>20)*(lane.x>>scale_bits)+((slot>>8)&(scale-1));
+
+        this->refill<Checked>(lane);
+
+        return static_cast<uint8_t>(slot);
+      }
+
+      template <bool Checked>
+      inline uint32_t raw(const int _lane, const int _bits) noexcept
+      {
+        Lane &lane = this->lanes[_lane];
+
+        const uint32_t value = lane.x&((uint64_t(1)<<_bits)-1);
+        lane.x >>= _bits;
+
+        this->refill<Checked>(lane);
+
+        return value;
+      }
+
+      template <bool Checked>
+      inline void refill(Lane &_lane) noexcept
+      {
+        const bool needed = (_lane.x < rans_low);
+        const bool available = !Checked || (_lane.ptr != _lane.end);
+
+        uint32_t word = 0;
+        if (available)
+          word = _lane.ptr[0]|(_lane.ptr[1]<<8)|(_lane.ptr[2]<<16)|(static_cast<uint32_t>(_lane.ptr[3])<<24);
+
+        if (Checked)
+          this->overrun |= needed && !available;
+
+        _lane.x = needed ? (_lane.x<<32)|word : _lane.x;
+        _lane.ptr += (needed && available) ? 4 : 0;
+      }
+    };
+
+    // encoder scratch, the symbols of a packet in decoding order
+    private: std::vector<Symbol> symbols;
+    private: std::vector<uint32_t> streams[lanes];
+
+    /// Largest packet _count records of _size bytes can be coded into
+    public: static size_t maxPacketSize(const size_t _size, const size_t _count) noexcept
+    {
+      // at most 12 bits per modelled symbol, a record has 3 of them and no
+      // more raw bits than bytes, plus the flush of every lane
+      return header_size+4*lanes+_size+_count*5;
+    }
+
+    /// The low _layer bits of _path in reverse order, the left to right
+    /// position of the node within its layer, and back
+    public: static inline uint32_t reverse(uint32_t _path, const int _layer) noexcept
+    {
+      _path = ((_path>>1)&0x55555555u)|((_path&0x55555555u)<<1);
+      _path = ((_path>>2)&0x33333333u)|((_path&0x33333333u)<<2);
+      _path = ((_path>>4)&0x0f0f0f0fu)|((_path&0x0f0f0f0fu)<<4);
+      _path = __builtin_bswap32(_path);
+
+      return (_layer == 0) ? 0 : (_path>>(32-_layer));
+    }
+
+    /// Codes the whole records of _src. Returns the size of the packet, 0 if
+    /// _capacity is too small, there are more than max_records records or
+    /// one isn't of the wire formats. Path bits past the layer are dropped.
+    public: size_t encode(const uint8_t *_src, const size_t _size, uint8_t *_dst, const size_t _capacity)
+    {
+      const Models &models = PacketCoder::models();
+
+      this->symbols.clear();
+
+      size_t count = 0;
+      Run run;
+      Checksum sum;
+
+      for (size_t offset = 0; offset < _size; ++count)
+      {
+        const uint8_t *record = _src+offset;
+        const size_t size = Frame::recordSize(record[0]);
+
+        if (offset+size > _size)
+          break;
+
+        offset += size;
+
+        const auto type = static_cast<FrameHeader::HeaderType>(record[0]&~Frame::mean_flag);
+        const int layer = record[1];
+
+        uint8_t kind;
+
+        if (type == FrameHeader::HeaderType::Sync)
+          kind = sync_kind;
+        else if ((layer > FrameLocation::wire_layers) || (record[0] & Frame::mean_flag))
+          return 0;
+        else if (type == FrameHeader::HeaderType::Image)
+          kind = layer;
+        else if (type == FrameHeader::HeaderType::Detail)
+          kind = layer|detail_flag;
+        else
+          return 0;
+
+        const bool channel = (kind != sync_kind) && (record[5] != 0);
+
+        // lanes as decode() reads them
+        this->pushModel(0, models.header, ((kind-run.kind)&kind_mask)|(channel ? channel_flag : 0));
+
+        if (kind != run.kind)
+          run = {kind, 0, 0, false};
+
+        if (kind == sync_kind)
+        {
+          for (int i = 0; i < 8; ++i)
+            this->pushRaw(i%lanes, record[i], 8);
+
+          sum.add(Checksum::load(record, size));
+          continue;
+        }
+
+        if (channel)
+          this->pushRaw(0, record[5], 8);
+
+        const uint32_t path = (record[2]|(record[3]<<8)|(record[4]<<16))&((1u<<layer)-1);
+
+        // the record as decode() will write it
+        sum.add((Checksum::load(record, size)&~(uint64_t(0xffffff)<<16))|(static_cast<uint64_t>(path)<<16));
+
+        const int32_t position = reverse(path, layer);
+        const int32_t gap = position-run.position;
+        const int32_t change = gap-run.gap;
+        const uint32_t symbol = (static_cast<uint32_t>(change)<<1)^static_cast<uint32_t>(change>>31);
+
+        if (symbol < escape)
+          this->pushModel(0, models.gap[run.escaped], symbol);
+        else
+        {
+          this->pushModel(0, models.gap[run.escaped], escape);
+          this->pushRaw(0, position, layer);
+        }
+
+        run.position = position;
+        run.gap = gap;
+        run.escaped = (symbol >= escape);
+
+        if (type == FrameHeader::HeaderType::Detail)
+          this->pushModel(1, models.values[layer], record[6]);
+        else
+        {
+          this->pushRaw(1, record[6], 8);
+          this->pushModel(1, models.values[layer], static_cast<uint8_t>(record[6]-record[7]));
+        }
+      }
+
+      if (count > max_records)
+        return 0;
+
+      // rANS goes backwards, the streams are written from their ends
+      uint64_t states[lanes];
+      uint32_t *ptrs[lanes];
+
+      for (int l = 0; l < lanes; ++l)
+      {
+        this->streams[l].resize(maxPacketSize(_size, count)/4);
+
+        states[l] = rans_low;
+        ptrs[l] = this->streams[l].data()+this->streams[l].size();
+      }
+
+      for (size_t i = this->symbols.size(); i-- > 0;)
+      {
+        const Symbol &symbol = this->symbols[i];
+        uint64_t &x = states[symbol.lane];
+        const uint64_t x_max = ((rans_low>>symbol.bits)<<32)*symbol.freq;
+
+        if (x >= x_max)
+        {
+          *--ptrs[symbol.lane] = static_cast<uint32_t>(x);
+          x >>= 32;
+        }
+
+        if (symbol.freq == 1)
+          x = (x<<symbol.bits)+symbol.start;
+        else
+          x = ((x/symbol.freq)<<symbol.bits)+(x%symbol.freq)+symbol.start;
+      }
+
+      size_t words[lanes];
+      for (int l = 0; l < lanes; ++l)
+      {
+        assert(ptrs[l] >= this->streams[l].data());
+        words[l] = this->streams[l].data()+this->streams[l].size()-ptrs[l];
+      }
+
+      const size_t size = header_size+4*(words[0]+words[1]);
+
+      if ((size > _capacity) || (words[0] > 0xffff))
+        return 0;
+
+      _dst[0] = count;
+      _dst[1] = count>>8;
+      _dst[2] = words[0];
+      _dst[3] = words[0]>>8;
+
+      const uint16_t checksum = sum.value();
+      _dst[4] = checksum;
+      _dst[5] = checksum>>8;
+
+      for (int l = 0; l < lanes; ++l)
+        for (int i = 0; i < 8; ++i)
+          _dst[6+8*l+i] = states[l]>>(8*i);
+
+      uint8_t *dst = _dst+header_size;
+
+      for (int l = 0; l < lanes; ++l)
+        for (size_t w = 0; w < words[l]; ++w, dst += 4)
+          for (int i = 0; i < 4; ++i)
+            dst[i] = ptrs[l][w]>>(8*i);
+
+      return size;
+    }
+
+    /// Writes the records of a packet to _dst. Returns their total size, 0
+    /// if _capacity is too small or the packet is damaged
+    public: static size_t decode(const uint8_t *_src, const size_t _size, uint8_t *_dst, const size_t _capacity) noexcept
+    {
+      // the streams are whole words
+      if ((_size < header_size) || ((_size-header_size)%4 != 0))
+        return 0;
+
+      const Models &models = PacketCoder::models();
+
+      const size_t count = _src[0]|(_src[1]<<8);
+      const size_t split = header_size+4*(_src[2]|(_src[3]<<8));
+
+      if (split > _size)
+        return 0;
+
+      Decoder state;
+      for (int l = 0; l < lanes; ++l)
+      {
+        Lane &lane = state.lanes[l];
+
+        lane.x = 0;
+        for (int i = 0; i < 8; ++i)
+          lane.x |= static_cast<uint64_t>(_src[6+8*l+i])<<(8*i);
+
+        if (lane.x < rans_low)
+          return 0;
+      }
+
+      state.lanes[0].ptr = _src+header_size;
+      state.lanes[0].end = _src+split;
+      state.lanes[1].ptr = _src+split;
+      state.lanes[1].end = _src+_size;
+
+      uint8_t *dst = _dst;
+      uint8_t *const dst_end = _dst+_capacity;
+
+      for (size_t i = 0; (i < count) && dst; ++i)
+      {
+        if (state.roomy())
+          dst = decodeRecord<false>(state, models, dst, dst_end);
+        else
+          dst = decodeRecord<true>(state, models, dst, dst_end);
+      }
+
+      if (!dst)
+        return 0;
+
+      if (state.overrun)
+        return 0;
+
+      // the encoder started from rans_low and every word got used
+      for (const auto &lane : state.lanes)
+        if ((lane.x != rans_low) || (lane.ptr != lane.end))
+          return 0;
+
+      if (state.sum.value() != (_src[4]|(_src[5]<<8)))
+        return 0;
+
+      return dst-_dst;
+    }
+
+    /// Decodes one record to _dst, returns the end of it, nullptr if it
+    /// doesn't fit or isn't valid
+    private: template <bool Checked>
+    static inline uint8_t *decodeRecord(Decoder &_state, const Models &_models,
+        uint8_t *_dst, const uint8_t *_dst_end) noexcept
+    {
+      Run &run = _state.run;
+
+      const uint8_t symbol = _state.model<Checked>(0, _models.header);
+      const uint8_t kind = (run.kind+symbol)&kind_mask;
+
+      if (kind != run.kind)
+        run = {kind, 0, 0, false};
+
+      const bool detail = (kind != sync_kind) && (kind & detail_flag);
+
+      if (static_cast<size_t>(_dst_end-_dst) < (detail ? Frame::detail_wire_size : Frame::wire_size))
+        return nullptr;
+
+      if (kind == sync_kind)
+      {
+        for (int b = 0; b < 8; ++b)
+          _dst[b] = _state.raw<Checked>(b%lanes, 8);
+
+        _state.sum.add(Checksum::load(_dst, Frame::wire_size));
+        return _dst+Frame::wire_size;
+      }
+
+      const int layer = kind&~detail_flag;
+
+      if (layer > FrameLocation::wire_layers)
+        return nullptr;
+
+      const uint8_t type = static_cast<uint8_t>(detail ? FrameHeader::HeaderType::Detail : FrameHeader::HeaderType::Image);
+      const uint8_t channel = (symbol & channel_flag) ? _state.raw<Checked>(0, 8) : 0;
+
+      _dst[0] = type;
+      _dst[1] = layer;
+      _dst[5] = channel;
+
+      const uint8_t change = _state.model<Checked>(0, _models.gap[run.escaped]);
+      const int32_t position = (change == escape) ? static_cast<int32_t>(_state.raw<Checked>(0, layer)) :
+          run.position+run.gap+(static_cast<int32_t>(change>>1)^-static_cast<int32_t>(change&1));
+
+      if ((position < 0) || (position >> layer))
+        return nullptr;
+
+      run.gap = position-run.position;
+      run.position = position;
+      run.escaped = (change == escape);
+
+      const uint32_t path = reverse(position, layer);
+
+      _dst[2] = path;
+      _dst[3] = path>>8;
+      _dst[4] = path>>16;
+
+      uint64_t record = type|(layer<<8)|(static_cast<uint64_t>(path)<<16)|(static_cast<uint64_t>(channel)<<40);
+
+      if (detail)
+      {
+        const uint8_t code = _state.model<Checked>(1, _models.values[layer]);
+
+        _dst[6] = code;
+        record |= static_cast<uint64_t>(code)<<48;
+      }
+      else
+      {
+        const uint8_t value_l = _state.raw<Checked>(1, 8);
+        const uint8_t value_r = value_l-_state.model<Checked>(1, _models.values[layer]);
+
+        _dst[6] = value_l;
+        _dst[7] = value_r;
+        record |= (static_cast<uint64_t>(value_l)<<48)|(static_cast<uint64_t>(value_r)<<56);
+      }
+
+      _state.sum.add(record);
+
+      return _dst+(detail ? Frame::detail_wire_size : Frame::wire_size);
+    }
+
+    private: void pushModel(const int _lane, const Model &_model, const uint8_t _symbol)
+    {
+      this->symbols.push_back({_model.start[_symbol], _model.freq[_symbol], scale_bits,
+                               static_cast<uint8_t>(_lane)});
+    }
+
+    private: void pushRaw(const int _lane, const uint32_t _value, const int _bits)
+    {
+      assert((_bits <= raw_bits) && (_value < (uint64_t(1)<<_bits)));
+
+      if (_bits > 0)
+        this->symbols.push_back({_value, 1, static_cast<uint8_t>(_bits), static_cast<uint8_t>(_lane)});
+    }
+
+    private: static const Models &models()
+    {
+      static const Models *models = buildModels();
+
+      return *models;
+    }
+
+    private: static Models *buildModels()
+    {
+      static Models models;
+
+      // same kind as the record before, or the next layer, on channel 0
+      float header[256];
+      std::fill(header, header+256, 1.f);
+      header[0] = 3500.f;
+      header[1] = 340.f;
+
+      buildModel(models.header, header);
+
+      // dealt records are evenly spaced, a gap mostly changes by nothing or
+      // a step, runs start with an escape or two
+      float gap[256];
+      for (int s = 0; s < 256; ++s)
+        gap[s] = std::exp(-s/0.7f);
+
+      gap[escape] = 0.04f;
+      buildModel(models.gap[0], gap);
+
+      gap[escape] = 8.0f;
+      buildModel(models.gap[1], gap);
+
+      // mean |value_l-value_r| falls by about a third every other layer,
+      // fitted on natural images
+      for (int l = 0; l <= FrameLocation::wire_layers; ++l)
+      {
+        const float spread = std::max(36.f*std::exp2(-l/5.5f), 1.5f);
+
+        float values[256];
+        for (int s = 0; s < 256; ++s)
+          values[s] = std::exp(-std::abs(static_cast<int8_t>(s))/spread);
+
+        buildModel(models.values[l], values);
+      }
+
+      return &models;
+    }
+
+    /// Frequencies proportional to _weights, every symbol gets at least one
+    /// slot, rounding leftovers go to symbol 0
+    private: static void buildModel(Model &_model, const float *_weights)
+    {
+      float sum = 0.f;
+      for (int s = 0; s < 256; ++s)
+        sum += _weights[s];
+
+      uint32_t total = 0;
+      for (int s = 0; s < 256; ++s)
+      {
+        _model.freq[s] = 1+static_cast<uint32_t>(_weights[s]/sum*(scale-256));
+        total += _model.freq[s];
+      }
+
+      assert(total <= scale);
+      _model.freq[0] += scale-total;
+
+      uint32_t start = 0;
+      for (uint32_t s = 0; s < 256; ++s)
+      {
+        // freq has 12 bits in a slot
+        assert(_model.freq[s] < scale);
+
+        _model.start[s] = start;
+
+        for (uint32_t slot = 0; slot < _model.freq[s]; ++slot)
+          _model.slots[start+slot] = s|(slot<<8)|(static_cast<uint32_t>(_model.freq[s])<<20);
+
+        start += _model.freq[s];
+      }
+    }
+  };
+};
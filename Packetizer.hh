@@ -0,0 +1,473 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+#include <algorithm>
+#include <vector>
+
+#include "Frame.hh"
+#include "PacketCoder.hh"
+
+
+namespace BIVCodec
+{
+  /// Splits a chain of wire records into datagrams of at most mtu bytes.
+  /// The records are sorted by layer and, within a layer, left to right
+  /// over the image, then dealt out round robin, so every packet gets its
+  /// share of each layer at an even stride across the image. Losing one
+  /// leaves small holes all over the picture, at every scale, instead of a
+  /// blank region.
+  /// A packet is a header:
+  /// - the type of its records, image or detail (1 byte)
+  /// - the sync record of the chain (8 bytes), any packet starts a picture
+  /// - number of the chain, counting up from 0 and wrapping (1 byte), the
+  ///   sync's timestamp is too coarse to tell pictures apart
+  /// - index of the packet and the number of packets of the chain (2 bytes
+  ///   each, little endian)
+  /// followed by its records in the sorted order, as runs of one layer:
+  /// - step of the layer from the previous run, the first one from 0 (1 byte)
+  /// - number of records (varint)
+  /// - per record, the change of its gap to the previous record of the run
+  ///   (zigzag varint), gaps taken on the reversed path, i.e. left to right;
+  ///   the dealing keeps them nearly constant, so it's mostly one 0 byte
+  /// - value_l and value_r, or the detail code
+  /// In the entropy format the type byte has entropy_flag set and the
+  /// records, in the same order, are a PacketCoder packet instead, which
+  /// models the same gaps and the values; a damaged one is rejected by its
+  /// checksum rather than read as wrong records.
+  enum class PacketFormat: uint8_t
+  {
+    Runs = 0,
+    Entropy
+  };
+
+  class Packetizer
+  {
+    public: static constexpr size_t header_size = 14;
+    public: static constexpr size_t max_packets = 0xffff;
+
+    // fits a UDP datagram over IPv6 with room for tunnel headers
+    public: static constexpr size_t default_mtu = 1200;
+    // a header and one run of one record always fit
+    public: static constexpr size_t min_mtu = header_size+16;
+    public: static constexpr uint8_t entropy_flag = 0x40;
+
+    private: struct Entry
+    {
+      // layer<<32 | reversed path
+      uint64_t key;
+      uint8_t value_l;
+      uint8_t value_r;
+    };
+
+    private: size_t mtu;
+    private: PacketFormat format;
+
+    private: uint8_t type = 0;
+    private: uint8_t sync[Frame::wire_size];
+    // number of the next chain
+    private: uint8_t chain = 0;
+
+    // records of the chain in packet order, before dealing
+    private: std::vector<Entry> entries;
+    private: std::vector<uint8_t> records;
+
+    // entropy format, the records of one packet and their coder
+    private: std::vector<uint8_t> packet_records;
+    private: PacketCoder coder;
+
+    // packets back to back, packet i is [offsets[i], offsets[i+1])
+    private: std::vector<uint8_t> data;
+    private: std::vector<size_t> offsets;
+
+    public: explicit Packetizer(const size_t _mtu = default_mtu,
+        const PacketFormat _format = PacketFormat::Runs):
+        mtu(_mtu), format(_format), offsets(1, 0)
+    {
+      assert(_mtu >= min_mtu);
+      assert((_format == PacketFormat::Runs) || (_mtu >= header_size+PacketCoder::maxPacketSize(Frame::wire_size, 1)));
+    }
+
+    /// Splits the chain _src, a sync record followed by image or detail
+    /// records of channel 0, into packets. Returns their number, 0 if the
+    /// chain isn't like that or needs more than max_packets of them. A
+    /// truncated record at the end is dropped.
+    public: size_t packetize(const uint8_t *_src, const size_t _size)
+    {
+      this->entries.clear();
+      this->data.clear();
+      this->offsets.assign(1, 0);
+
+      if ((_size < Frame::wire_size) ||
+          ((_src[0]&~Frame::mean_flag) != static_cast<uint8_t>(FrameHeader::HeaderType::Sync)))
+        return 0;
+
+      std::copy(_src, _src+Frame::wire_size, this->sync);
+
+      const uint8_t image = static_cast<uint8_t>(FrameHeader::HeaderType::Image);
+      const uint8_t detail = static_cast<uint8_t>(FrameHeader::HeaderType::Detail);
+
+      this->type = image;
+
+      for (size_t offset = Frame::wire_size; offset < _size; )
+      {
+        const uint8_t *record = _src+offset;
+        const size_t size = Frame::recordSize(record[0]);
+
+        if (offset+size > _size)
+          break;
+
+        const int layer = record[1];
+
+        if (((record[0] != image) && (record[0] != detail)) ||
+            ((offset != Frame::wire_size) && (record[0] != this->type)) ||
+            (layer > FrameLocation::wire_layers) || (record[5] != 0))
+          return 0;
+
+        offset += size;
+
+        this->type = record[0];
+
+        const uint32_t path = (record[2]|(record[3]<<8)|(record[4]<<16))&((1u<<layer)-1);
+
+        this->entries.push_back({(static_cast<uint64_t>(layer)<<32)|PacketCoder::reverse(path, layer),
+                                 record[6], (this->type == image) ? record[7] : uint8_t(0)});
+      }
+
+      std::sort(this->entries.begin(), this->entries.end(),
+          [](const Entry &_a, const Entry &_b) { return _a.key < _b.key; });
+
+      // a record mostly takes its values and a byte of gap, grow from there
+      // until every packet fits
+      const size_t record_size = 1+valueSize(this->type);
+      size_t count = (this->entries.size()*record_size+(this->mtu-header_size)-1)/(this->mtu-header_size);
+      count = std::max<size_t>(count, 1);
+
+      // entropy coded records take less, scale by how much of the first
+      // packet they fill
+      if ((this->format == PacketFormat::Entropy) && this->writePacket(0, count))
+      {
+        const size_t used = this->data.size()-header_size;
+        count = std::max<size_t>(count*used/(this->mtu-header_size), 1);
+
+        this->data.clear();
+        this->offsets.assign(1, 0);
+      }
+
+      while (count <= max_packets)
+      {
+        size_t index = 0;
+
+        while ((index < count) && this->writePacket(index, count))
+          ++index;
+
+        if (index == count)
+        {
+          this->chain++;
+          return count;
+        }
+
+        this->data.clear();
+        this->offsets.assign(1, 0);
+
+        count += count/64+1;
+      }
+
+      return 0;
+    }
+
+    /// Same for a chain of frames
+    public: size_t packetize(const std::vector<Frame> &_frames)
+    {
+      size_t size = 0;
+      for (const auto &frame : _frames)
+        size += frame.wireSize();
+
+      this->records.resize(size);
+      Frame::serializeRange(_frames, this->records.data(), size);
+
+      return this->packetize(this->records.data(), size);
+    }
+
+    public: size_t packetCount() const noexcept
+    {
+      return this->offsets.size()-1;
+    }
+
+    public: const uint8_t *packetData(const size_t _index) const noexcept
+    {
+      assert(_index < this->packetCount());
+      return this->data.data()+this->offsets[_index];
+    }
+
+    public: size_t packetSize(const size_t _index) const noexcept
+    {
+      assert(_index < this->packetCount());
+      return this->offsets[_index+1]-this->offsets[_index];
+    }
+
+    /// Largest size of the records packet _src unpacks to
+    public: static size_t maxRecordsSize(const uint8_t *_src, const size_t _size) noexcept
+    {
+      if (_size < header_size+PacketCoder::header_size)
+        return Frame::wire_size+((_size > header_size) ? (_size-header_size)*4 : 0);
+
+      // entropy coded records can take less than a byte, go by their count
+      if (_src[0] & entropy_flag)
+        return Frame::wire_size+(_src[header_size]|(_src[header_size+1]<<8))*Frame::wire_size;
+
+      return Frame::wire_size+(_size-header_size)*4;
+    }
+
+    /// Reads which chain a packet belongs to and where in it, false if _src
+    /// isn't a packet
+    public: static bool packetPosition(const uint8_t *_src, const size_t _size,
+        uint8_t &_chain, size_t &_index, size_t &_count) noexcept
+    {
+      if (_size < header_size)
+        return false;
+
+      _chain = _src[9];
+      _index = _src[10]|(_src[11]<<8);
+      _count = _src[12]|(_src[13]<<8);
+
+      return _index < _count;
+    }
+
+    /// Writes the sync record of a packet and its records, in packet order,
+    /// to _dst. Returns their total size, 0 if _capacity is too small or the
+    /// packet is damaged
+    public: static size_t depacketize(const uint8_t *_src, const size_t _size, uint8_t *_dst, const size_t _capacity) noexcept
+    {
+      if ((_size < header_size) || (_capacity < Frame::wire_size))
+        return 0;
+
+      const bool entropy = (_src[0] & entropy_flag);
+      const uint8_t type = _src[0]&~entropy_flag;
+
+      if (((type != static_cast<uint8_t>(FrameHeader::HeaderType::Image)) &&
+           (type != static_cast<uint8_t>(FrameHeader::HeaderType::Detail))) ||
+          ((_src[1]&~Frame::mean_flag) != static_cast<uint8_t>(FrameHeader::HeaderType::Sync)))
+        return 0;
+
+      std::copy(_src+1, _src+1+Frame::wire_size, _dst);
+
+      if (entropy)
+        return depacketizeEntropy(type, _src+header_size, _size-header_size,
+                                  _dst+Frame::wire_size, _capacity-Frame::wire_size);
+
+      const size_t record_size = Frame::recordSize(type);
+      const size_t value_size = valueSize(type);
+
+      size_t size = Frame::wire_size;
+
+      const uint8_t *src = _src+header_size;
+      const uint8_t *const end = _src+_size;
+
+      int layer = 0;
+
+      while (src != end)
+      {
+        layer += *src++;
+
+        uint32_t run;
+        if ((layer > FrameLocation::wire_layers) || !readVarint(src, end, run))
+          return 0;
+
+        int64_t key = 0;
+        int64_t gap = 0;
+
+        for (; run > 0; --run)
+        {
+          uint32_t step;
+          if (!readVarint(src, end, step))
+            return 0;
+
+          gap += static_cast<int64_t>(step>>1)^-static_cast<int64_t>(step&1);
+          key += gap;
+
+          if ((gap < 0) || (key >> layer) ||
+              (static_cast<size_t>(end-src) < value_size) || (_capacity-size < record_size))
+            return 0;
+
+          const uint32_t path = PacketCoder::reverse(static_cast<uint32_t>(key), layer);
+
+          uint8_t *record = _dst+size;
+          record[0] = type;
+          record[1] = layer;
+          record[2] = path;
+          record[3] = path>>8;
+          record[4] = path>>16;
+          record[5] = 0;
+          std::copy(src, src+value_size, record+6);
+
+          src += value_size;
+          size += record_size;
+        }
+      }
+
+      return size;
+    }
+
+    /// Appends packet _index of _count, false if it would be over mtu
+    private: bool writePacket(const size_t _index, const size_t _count)
+    {
+      const size_t begin = this->data.size();
+      this->data.resize(begin+this->mtu);
+
+      uint8_t *dst = &this->data[begin];
+      const uint8_t *const end = dst+this->mtu;
+
+      dst[0] = (this->format == PacketFormat::Entropy) ? (this->type|entropy_flag) : this->type;
+      std::copy(this->sync, this->sync+Frame::wire_size, dst+1);
+      dst[9] = this->chain;
+      dst[10] = _index;
+      dst[11] = _index>>8;
+      dst[12] = _count;
+      dst[13] = _count>>8;
+      dst += header_size;
+
+      if (this->format == PacketFormat::Entropy)
+        return this->writeEntropy(_index, _count, dst, end);
+
+      const size_t value_size = valueSize(this->type);
+      const size_t total = this->entries.size();
+
+      int layer = 0;
+
+      for (size_t i = _index; i < total; )
+      {
+        const int run_layer = this->entries[i].key>>32;
+
+        uint32_t run = 0;
+        for (size_t j = i; (j < total) && ((this->entries[j].key>>32) == static_cast<uint64_t>(run_layer)); j += _count)
+          ++run;
+
+        if (end-dst < 6)
+          return false;
+
+        *dst++ = run_layer-layer;
+        dst = writeVarint(dst, run);
+        layer = run_layer;
+
+        int64_t key = 0;
+        int64_t gap = 0;
+
+        for (; run > 0; --run, i += _count)
+        {
+          if (static_cast<size_t>(end-dst) < 5+value_size)
+            return false;
+
+          const Entry &entry = this->entries[i];
+          const int64_t next_gap = static_cast<int64_t>(entry.key&0xffffffff)-key;
+          const int64_t change = next_gap-gap;
+
+          dst = writeVarint(dst, static_cast<uint32_t>((static_cast<uint64_t>(change)<<1)^(change>>63)));
+          key += next_gap;
+          gap = next_gap;
+
+          *dst++ = entry.value_l;
+          if (value_size == 2)
+            *dst++ = entry.value_r;
+        }
+      }
+
+      this->data.resize(dst-this->data.data());
+      this->offsets.push_back(this->data.size());
+
+      return true;
+    }
+
+    /// Entropy format body of packet _index of _count, from _dst on
+    private: bool writeEntropy(const size_t _index, const size_t _count, uint8_t *_dst, const uint8_t *_end)
+    {
+      const size_t record_size = Frame::recordSize(this->type);
+      const size_t total = this->entries.size();
+
+      this->packet_records.clear();
+
+      for (size_t i = _index; i < total; i += _count)
+      {
+        const Entry &entry = this->entries[i];
+        const int layer = entry.key>>32;
+        const uint32_t path = PacketCoder::reverse(static_cast<uint32_t>(entry.key), layer);
+
+        const uint8_t record[Frame::wire_size] = {this->type, static_cast<uint8_t>(layer),
+            static_cast<uint8_t>(path), static_cast<uint8_t>(path>>8), static_cast<uint8_t>(path>>16),
+            0, entry.value_l, entry.value_r};
+
+        this->packet_records.insert(this->packet_records.end(), record, record+record_size);
+      }
+
+      // a packet past the last record is only the header
+      size_t size = 0;
+
+      if (!this->packet_records.empty())
+      {
+        size = this->coder.encode(this->packet_records.data(), this->packet_records.size(), _dst, _end-_dst);
+        if (size == 0)
+          return false;
+      }
+
+      this->data.resize(_dst+size-this->data.data());
+      this->offsets.push_back(this->data.size());
+
+      return true;
+    }
+
+    /// Entropy format records, the checksum rules out damage but not
+    /// records of another type than the header's
+    private: static size_t depacketizeEntropy(const uint8_t _type, const uint8_t *_src, const size_t _size,
+        uint8_t *_dst, const size_t _capacity) noexcept
+    {
+      if (_size == 0)
+        return Frame::wire_size;
+
+      const size_t size = PacketCoder::decode(_src, _size, _dst, _capacity);
+      const size_t record_size = Frame::recordSize(_type);
+
+      if ((size == 0) || (size%record_size != 0))
+        return 0;
+
+      for (size_t offset = 0; offset < size; offset += record_size)
+        if ((_dst[offset] != _type) || (_dst[offset+1] > FrameLocation::wire_layers) || (_dst[offset+5] != 0))
+          return 0;
+
+      return Frame::wire_size+size;
+    }
+
+    /// Bytes of values per record of _type
+    private: static inline size_t valueSize(const uint8_t _type) noexcept
+    {
+      return Frame::recordSize(_type)-6;
+    }
+
+    private: static inline uint8_t *writeVarint(uint8_t *_dst, uint32_t _value) noexcept
+    {
+      for (; _value >= 0x80; _value >>= 7)
+        *_dst++ = static_cast<uint8_t>(_value|0x80);
+
+      *_dst++ = static_cast<uint8_t>(_value);
+
+      return _dst;
+    }
+
+    private: static inline bool readVarint(const uint8_t *&_src, const uint8_t *_end, uint32_t &_value) noexcept
+    {
+      _value = 0;
+
+      for (int shift = 0; (shift < 35) && (_src != _end); shift += 7)
+      {
+        const uint8_t byte = *_src++;
+        _value |= static_cast<uint32_t>(byte&0x7f)<<shift;
+
+        if (!(byte & 0x80))
+          return true;
+      }
+
+      return false;
+    }
+  };
+};
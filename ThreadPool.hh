@@ -0,0 +1,227 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace BIVCodec
+{
+  /// Work-stealing pool: each worker owns a deque, pops its own tasks from
+  /// the back and steals from the front of the others when it runs dry.
+  class ThreadPool
+  {
+    public: using Task = std::function<void()>;
+
+    private: struct WorkQueue
+    {
+      std::mutex lock;
+      std::deque<Task> tasks;
+    };
+
+    private: std::vector<std::unique_ptr<WorkQueue>> queues;
+    private: std::vector<std::thread> workers;
+
+    private: std::mutex idle_lock;
+    private: std::condition_variable idle_cv;
+    private: std::mutex done_lock;
+    private: std::condition_variable done_cv;
+
+    // queued - waiting in some deque, pending - queued or running
+    private: std::atomic<size_t> queued {0};
+    private: std::atomic<size_t> pending {0};
+    private: std::atomic<unsigned> next_queue {0};
+    private: bool stopping = false;
+
+    public: explicit ThreadPool(const unsigned _threads = std::thread::hardware_concurrency())
+    {
+      const unsigned count = std::max(_threads, 1u);
+
+      for (unsigned i = 0; i < count; ++i)
+        this->queues.emplace_back(new WorkQueue());
+
+      for (unsigned i = 0; i < count; ++i)
+        this->workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+
+    public: ThreadPool(const ThreadPool &) = delete;
+    public: ThreadPool &operator=(const ThreadPool &) = delete;
+
+    public: ~ThreadPool()
+    {
+      this->wait();
+
+      {
+        std::lock_guard<std::mutex> guard(this->idle_lock);
+        this->stopping = true;
+      }
+      this->idle_cv.notify_all();
+
+      for (auto &worker : this->workers)
+        worker.join();
+    }
+
+    public: unsigned size() const noexcept
+    {
+      return this->workers.size();
+    }
+
+    /// Tasks spawned by a worker go to its own deque, others are spread round-robin
+    public: void submit(Task _task)
+    {
+      int self = this->currentWorker();
+      unsigned id = (self >= 0) ? self : (this->next_queue++ % this->queues.size());
+
+      this->pending++;
+
+      {
+        std::lock_guard<std::mutex> guard(this->queues[id]->lock);
+        this->queues[id]->tasks.push_back(std::move(_task));
+      }
+
+      {
+        std::lock_guard<std::mutex> guard(this->idle_lock);
+        this->queued++;
+      }
+      this->idle_cv.notify_one();
+    }
+
+    /// Blocks until every submitted task is finished, the caller helps meanwhile
+    public: void wait()
+    {
+      while (this->pending > 0)
+      {
+        if (this->tryRunTask(this->currentWorker()))
+          continue;
+
+        std::unique_lock<std::mutex> guard(this->done_lock);
+        this->done_cv.wait(guard, [this] { return (this->pending == 0) || (this->queued > 0); });
+      }
+    }
+
+    /// Runs _body(0.._count-1) on the pool and waits for these tasks only
+    public: void parallelFor(const size_t _count, const std::function<void(size_t)> &_body)
+    {
+      std::atomic<size_t> remaining {_count};
+
+      for (size_t i = 0; i < _count; ++i)
+        this->submit([this, &_body, &remaining, i]
+          {
+            _body(i);
+
+            if (--remaining == 0)
+            {
+              { std::lock_guard<std::mutex> guard(this->done_lock); }
+              this->done_cv.notify_all();
+            }
+          });
+
+      while (remaining > 0)
+      {
+        if (this->tryRunTask(this->currentWorker()))
+          continue;
+
+        std::unique_lock<std::mutex> guard(this->done_lock);
+        this->done_cv.wait(guard, [this, &remaining] { return (remaining == 0) || (this->queued > 0); });
+      }
+    }
+
+    private: int &workerSlot() const noexcept
+    {
+      static thread_local int id = -1;
+      return id;
+    }
+
+    private: const ThreadPool *&workerOwner() const noexcept
+    {
+      static thread_local const ThreadPool *owner = nullptr;
+      return owner;
+    }
+
+    private: int currentWorker() const noexcept
+    {
+      return (this->workerOwner() == this) ? this->workerSlot() : -1;
+    }
+
+    private: bool popTask(const int _self, Task &_task)
+    {
+      const int count = this->queues.size();
+
+      if (_self >= 0)
+      {
+        auto &own = *this->queues[_self];
+        std::lock_guard<std::mutex> guard(own.lock);
+
+        if (!own.tasks.empty())
+        {
+          _task = std::move(own.tasks.back());
+          own.tasks.pop_back();
+          return true;
+        }
+      }
+
+      for (int i = 1; i <= count; ++i)
+      {
+        const int victim = (std::max(_self, 0)+i) % count;
+
+        if (victim == _self)
+          continue;
+
+        auto &other = *this->queues[victim];
+        std::lock_guard<std::mutex> guard(other.lock);
+
+        if (!other.tasks.empty())
+        {
+          _task = std::move(other.tasks.front());
+          other.tasks.pop_front();
+          return true;
+        }
+      }
+
+      return false;
+    }
+
+    private: bool tryRunTask(const int _self)
+    {
+      Task task;
+
+      if (!this->popTask(_self, task))
+        return false;
+
+      this->queued--;
+      task();
+
+      if (--this->pending == 0)
+      {
+        { std::lock_guard<std::mutex> guard(this->done_lock); }
+        this->done_cv.notify_all();
+      }
+
+      return true;
+    }
+
+    private: void workerLoop(const unsigned _id)
+    {
+      this->workerOwner() = this;
+      this->workerSlot() = _id;
+
+      while (true)
+      {
+        if (this->tryRunTask(_id))
+          continue;
+
+        std::unique_lock<std::mutex> guard(this->idle_lock);
+        this->idle_cv.wait(guard, [this] { return this->stopping || (this->queued > 0); });
+
+        if (this->stopping && (this->queued == 0))
+          break;
+      }
+    }
+  };
+};
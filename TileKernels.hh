@@ -0,0 +1,228 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+
+namespace BIVCodec
+{
+  /// Bottom four layers of a 4x4 tile. The tile splits vertically into
+  /// 4x2 halves, those horizontally into 2x2 quads, then vertically into
+  /// 2x1 pairs and finally into pixels, as splitRect does for square tiles.
+  /// Every value is (l+r)/2 of its children, bit-exact with the recursion.
+  struct TileValues
+  {
+    float pixels[4][4];       // [row][col]
+    float pairs[4][2];        // 2x1 nodes, [row][col/2]
+    float quads[2][2];        // 2x2 nodes, [row/2][col/2]
+    float halves[2];          // 4x2 nodes, [row/2]
+    float value;              // the tile itself
+  };
+
+  namespace TileKernels
+  {
+    template <typename T>
+    inline void reduceTileScalar(const T *_src, const ptrdiff_t _stride, TileValues &_out) noexcept
+    {
+      for (int r = 0; r < 4; ++r)
+        for (int c = 0; c < 4; ++c)
+          _out.pixels[r][c] = _src[r*_stride + c];
+
+      for (int r = 0; r < 4; ++r)
+        for (int c = 0; c < 2; ++c)
+          _out.pairs[r][c] = (_out.pixels[r][2*c]+_out.pixels[r][2*c+1])/2;
+
+      for (int r = 0; r < 2; ++r)
+        for (int c = 0; c < 2; ++c)
+          _out.quads[r][c] = (_out.pairs[2*r][c]+_out.pairs[2*r+1][c])/2;
+
+      for (int r = 0; r < 2; ++r)
+        _out.halves[r] = (_out.quads[r][0]+_out.quads[r][1])/2;
+
+      _out.value = (_out.halves[0]+_out.halves[1])/2;
+    }
+
+#if defined(__SSE2__)
+    inline __m128 loadRow4(const float *_src) noexcept
+    {
+      return _mm_loadu_ps(_src);
+    }
+
+    inline __m128 loadRow4(const uint8_t *_src) noexcept
+    {
+      int32_t bytes;
+      std::memcpy(&bytes, _src, sizeof(bytes));
+
+      const __m128i zero = _mm_setzero_si128();
+      __m128i words = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero);
+
+      return _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero));
+    }
+
+    /// lanes of _h hold [pairs[r][0], pairs[r][1], pairs[r+1][0], pairs[r+1][1]]
+    inline __m128 pairRows(const __m128 _row_a, const __m128 _row_b, const __m128 _half) noexcept
+    {
+      __m128 even = _mm_shuffle_ps(_row_a, _row_b, _MM_SHUFFLE(2,0,2,0));
+      __m128 odd = _mm_shuffle_ps(_row_a, _row_b, _MM_SHUFFLE(3,1,3,1));
+
+      return _mm_mul_ps(_mm_add_ps(even, odd), _half);
+    }
+
+    template <typename T>
+    inline void reduceTileSSE(const T *_src, const ptrdiff_t _stride, TileValues &_out) noexcept
+    {
+      const __m128 half = _mm_set1_ps(0.5f);
+
+      __m128 r0 = loadRow4(_src);
+      __m128 r1 = loadRow4(_src+_stride);
+      __m128 r2 = loadRow4(_src+2*_stride);
+      __m128 r3 = loadRow4(_src+3*_stride);
+
+      _mm_storeu_ps(_out.pixels[0], r0);
+      _mm_storeu_ps(_out.pixels[1], r1);
+      _mm_storeu_ps(_out.pixels[2], r2);
+      _mm_storeu_ps(_out.pixels[3], r3);
+
+      __m128 h01 = pairRows(r0, r1, half);
+      __m128 h23 = pairRows(r2, r3, half);
+
+      _mm_storeu_ps(_out.pairs[0], h01);
+      _mm_storeu_ps(_out.pairs[2], h23);
+
+      __m128 q0 = _mm_mul_ps(_mm_add_ps(h01, _mm_movehl_ps(h01, h01)), half);
+      __m128 q1 = _mm_mul_ps(_mm_add_ps(h23, _mm_movehl_ps(h23, h23)), half);
+      __m128 q = _mm_movelh_ps(q0, q1);
+
+      _mm_storeu_ps(_out.quads[0], q);
+
+      __m128 s = pairRows(q, q, half);
+
+      _out.halves[0] = _mm_cvtss_f32(s);
+      _out.halves[1] = _mm_cvtss_f32(_mm_shuffle_ps(s, s, _MM_SHUFFLE(1,1,1,1)));
+      _out.value = (_out.halves[0]+_out.halves[1])/2;
+    }
+#endif
+
+#if defined(__AVX2__)
+    inline __m256 loadRow8(const float *_src) noexcept
+    {
+      return _mm256_loadu_ps(_src);
+    }
+
+    inline __m256 loadRow8(const uint8_t *_src) noexcept
+    {
+      return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(_src))));
+    }
+
+    /// Same steps as reduceTileSSE, each 128bit lane carries its own tile
+    template <typename T>
+    inline void reduceTilePairAVX2(const T *_src, const ptrdiff_t _stride, TileValues *_out) noexcept
+    {
+      const __m256 half = _mm256_set1_ps(0.5f);
+
+      __m256 r0 = loadRow8(_src);
+      __m256 r1 = loadRow8(_src+_stride);
+      __m256 r2 = loadRow8(_src+2*_stride);
+      __m256 r3 = loadRow8(_src+3*_stride);
+
+      auto pair_rows = [&half](const __m256 _a, const __m256 _b)
+        {
+          __m256 even = _mm256_shuffle_ps(_a, _b, _MM_SHUFFLE(2,0,2,0));
+          __m256 odd = _mm256_shuffle_ps(_a, _b, _MM_SHUFFLE(3,1,3,1));
+
+          return _mm256_mul_ps(_mm256_add_ps(even, odd), half);
+        };
+
+      __m256 h01 = pair_rows(r0, r1);
+      __m256 h23 = pair_rows(r2, r3);
+
+      // per-lane movehl/movelh
+      __m256 h01_hi = _mm256_castpd_ps(_mm256_unpackhi_pd(_mm256_castps_pd(h01), _mm256_castps_pd(h01)));
+      __m256 h23_hi = _mm256_castpd_ps(_mm256_unpackhi_pd(_mm256_castps_pd(h23), _mm256_castps_pd(h23)));
+      __m256 q0 = _mm256_mul_ps(_mm256_add_ps(h01, h01_hi), half);
+      __m256 q1 = _mm256_mul_ps(_mm256_add_ps(h23, h23_hi), half);
+      __m256 q = _mm256_castpd_ps(_mm256_unpacklo_pd(_mm256_castps_pd(q0), _mm256_castps_pd(q1)));
+
+      __m256 s = pair_rows(q, q);
+
+      const __m256 rows[4] = {r0, r1, r2, r3};
+
+      for (int t = 0; t < 2; ++t)
+      {
+        auto lane = [t](const __m256 _v)
+          { return t ? _mm256_extractf128_ps(_v, 1) : _mm256_castps256_ps128(_v); };
+
+        for (int r = 0; r < 4; ++r)
+          _mm_storeu_ps(_out[t].pixels[r], lane(rows[r]));
+
+        _mm_storeu_ps(_out[t].pairs[0], lane(h01));
+        _mm_storeu_ps(_out[t].pairs[2], lane(h23));
+        _mm_storeu_ps(_out[t].quads[0], lane(q));
+
+        __m128 s_lane = lane(s);
+        _out[t].halves[0] = _mm_cvtss_f32(s_lane);
+        _out[t].halves[1] = _mm_cvtss_f32(_mm_shuffle_ps(s_lane, s_lane, _MM_SHUFFLE(1,1,1,1)));
+        _out[t].value = (_out[t].halves[0]+_out[t].halves[1])/2;
+      }
+    }
+#endif
+
+    /// Row span fill, the innermost loop of every render
+    template <typename T>
+    inline void fillRow(T *_dst, const int _count, const T _value) noexcept
+    {
+      std::fill_n(_dst, _count, _value);
+    }
+
+    inline void fillRow(uint8_t *_dst, const int _count, const uint8_t _value) noexcept
+    {
+      std::memset(_dst, _value, _count);
+    }
+
+#if defined(__SSE2__)
+    inline void fillRow(float *_dst, const int _count, const float _value) noexcept
+    {
+      const __m128 value = _mm_set1_ps(_value);
+
+      int i = 0;
+      for (; i+8 <= _count; i += 8)
+      {
+        _mm_storeu_ps(_dst+i, value);
+        _mm_storeu_ps(_dst+i+4, value);
+      }
+
+      for (; i < _count; ++i)
+        _dst[i] = _value;
+    }
+#endif
+
+    /// Reduces _count horizontally adjacent 4x4 tiles, _src points at the
+    /// top-left pixel of the first one. 8 bit pixels are widened on load.
+    template <typename T>
+    inline void reduceTiles(const T *_src, const ptrdiff_t _stride, const int _count, TileValues *_out) noexcept
+    {
+      int i = 0;
+
+#if defined(__AVX2__)
+      for (; i+2 <= _count; i += 2)
+        reduceTilePairAVX2(_src+4*i, _stride, _out+i);
+#endif
+
+      for (; i < _count; ++i)
+      {
+#if defined(__SSE2__)
+        reduceTileSSE(_src+4*i, _stride, _out[i]);
+#else
+        reduceTileScalar(_src+4*i, _stride, _out[i]);
+#endif
+      }
+    }
+  };
+};
@@ -0,0 +1,254 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <ctime>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "Frame.hh"
+
+
+namespace BIVCodec
+{
+  /// Sender side encoder, goes from an image straight to serialized frames
+  /// in the same order ImageBSP::asFrameChain produces them, without building
+  /// any ImageNode or Frame. The split geometry comes from a shared
+  /// GeometryPlan and scratch buffers are kept between calls, so encoding a
+  /// stream of same-sized images neither splits a rect nor allocates.
+  /// Chains are pair or detail coded, see FrameCoding.
+  class WireEncoder
+  {
+    private: static constexpr size_t block_records = 4096;
+
+    private: std::shared_ptr<const GeometryPlan> plan;
+
+    // everything a record needs in one place, emission reads them at random
+    private: struct NodeRecord
+    {
+      uint32_t path;
+      float value_l;
+      float value_r;
+    };
+
+    // geometry, values and sync of the last encoded image
+    private: std::shared_ptr<const GeometryPlan> encoded;
+    private: std::vector<NodeRecord> node_records;
+    private: std::vector<float> leaf_values;
+    // detail coding, the lifted value of every node and its code
+    private: std::vector<int16_t> lifted;
+    private: std::vector<FrameDetailData::Code> codes;
+    private: std::vector<float> decoded;
+    private: FrameSyncData sync;
+
+    private: int max_layers;
+    private: FrameCoding coding;
+
+    public: explicit WireEncoder(const int _layers = ImageBSP::max_layers,
+        const FrameCoding _coding = FrameCoding::Pair):
+        max_layers(_layers), coding(_coding)
+    {
+      assert((_layers > 0) && (_layers <= ImageBSP::max_layers));
+    }
+
+    /// Size of every record but the sync one
+    public: size_t recordSize() const noexcept
+    {
+      return (this->coding == FrameCoding::Detail) ? Frame::detail_wire_size : Frame::wire_size;
+    }
+
+    /// Number of frames, sync included, an image of this size is encoded into
+    public: size_t frameCount(const int _width, const int _height)
+    {
+      return 1+this->planFor(_width, _height).nodes.size();
+    }
+
+    public: size_t wireSize(const int _width, const int _height)
+    {
+      return Frame::wire_size+this->planFor(_width, _height).nodes.size()*this->recordSize();
+    }
+
+    /// Returns the number of bytes written, 0 if _capacity is too small.
+    /// Every record is placed independently, with a pool blocks of them are
+    /// written concurrently
+    public: template <typename T>
+    size_t encode(const ImageMatrixT<T> &_src, uint8_t *_dst, const size_t _capacity,
+        ThreadPool *_pool = nullptr)
+    {
+      assert(_src.width >= 2);
+      assert(_src.height >= 1);
+
+      const GeometryPlan &plan = this->planFor(_src.width, _src.height);
+      const size_t records = plan.nodes.size();
+      const size_t record_size = this->recordSize();
+
+      if (Frame::wire_size+records*record_size > _capacity)
+        return 0;
+
+      this->computeValues(_src, plan);
+      this->encoded = this->plan;
+
+      if (this->coding == FrameCoding::Detail)
+        this->computeCodes(plan);
+
+      this->sync.width = _src.width;
+      this->sync.ratio = static_cast<float>(_src.height)/_src.width;
+      this->sync.color_format = ColorSpace::Grayscale;
+      this->sync.id = -1;
+      this->sync.mean = (this->coding == FrameCoding::Detail) ? this->liftedValue(plan.root) : -1;
+      this->sync.timestamp = static_cast<uint32_t>(std::time(nullptr));
+
+      Frame::writeSyncRecord(_dst, this->sync);
+
+      uint8_t *dst = _dst+Frame::wire_size;
+      const size_t blocks = (records+block_records-1)/block_records;
+
+      auto write_block = [this, dst, records, record_size](const size_t _id)
+        {
+          const size_t begin = _id*block_records;
+          this->writeRecords(begin, std::min(begin+block_records, records), dst+begin*record_size);
+        };
+
+      if (_pool && (blocks > 1))
+        _pool->parallelFor(blocks, write_block);
+      else
+        for (size_t i = 0; i < blocks; ++i)
+          write_block(i);
+
+      return Frame::wire_size+records*record_size;
+    }
+
+    /// Rewrites record _id, 0 being the sync, of the last encoded chain, e.g.
+    /// for a retransmission. _dst has to hold Frame::wire_size bytes for the
+    /// sync, recordSize() for the rest
+    public: void writeFrame(const size_t _id, uint8_t *_dst) const
+    {
+      assert(this->encoded && (_id <= this->encoded->nodes.size()));
+
+      if (_id == 0)
+        Frame::writeSyncRecord(_dst, this->sync);
+      else
+        this->writeRecords(_id-1, _id, _dst);
+    }
+
+    /// Image records [_begin, _end) of the last encoded chain, numbered
+    /// after the sync one
+    private: void writeRecords(const size_t _begin, const size_t _end, uint8_t *_dst) const
+    {
+      const GeometryPlan &plan = *this->encoded;
+      const bool detail = (this->coding == FrameCoding::Detail);
+
+      int l = static_cast<int>(std::upper_bound(plan.layer_begin.begin(), plan.layer_begin.end(), _begin)-
+                               plan.layer_begin.begin())-1;
+
+      LayerPermutation permutation(plan.layerSize(l), l);
+
+      for (size_t r = _begin; r < _end; ++r)
+      {
+        while (r >= plan.layer_begin[l+1])
+        {
+          l++;
+          if (plan.layerSize(l) > 0)
+            permutation = LayerPermutation(plan.layerSize(l), l);
+        }
+
+        const size_t begin = plan.layer_begin[l];
+        const size_t id = begin+permutation(r-begin);
+        const auto &node = this->node_records[id];
+
+        if (detail)
+        {
+          Frame::writeDetailRecord(_dst, l, node.path, 0, this->codes[id]);
+          _dst += Frame::detail_wire_size;
+        }
+        else
+        {
+          Frame::writeImageRecord(_dst, l, node.path, 0, node.value_l, node.value_r);
+          _dst += Frame::wire_size;
+        }
+      }
+    }
+
+    private: const GeometryPlan &planFor(const int _width, const int _height)
+    {
+      if (!this->plan || (this->plan->width != _width) || (this->plan->height != _height))
+        this->plan = GeometryPlan::get(_width, _height, this->max_layers);
+
+      return *this->plan;
+    }
+
+    private: inline float value(const int32_t _ref) const noexcept
+    {
+      if (_ref < 0)
+        return this->leaf_values[~_ref];
+
+      const auto &node = this->node_records[_ref];
+      return (node.value_l+node.value_r)/2;
+    }
+
+    private: inline int liftedValue(const int32_t _ref) const noexcept
+    {
+      return (_ref < 0) ? FrameSyncData::quantizeMean(this->leaf_values[~_ref]) : this->lifted[_ref];
+    }
+
+    /// Lifts the values up from the leaves, then picks the codes from the
+    /// root down, each against what the decoder makes of the ones above
+    private: void computeCodes(const GeometryPlan &_plan)
+    {
+      const size_t count = _plan.nodes.size();
+
+      this->lifted.resize(count);
+      this->codes.resize(count);
+
+      for (size_t i = count; i-- > 0;)
+        this->lifted[i] = FrameDetailData::liftValue(this->liftedValue(_plan.nodes[i].left),
+                                                     this->liftedValue(_plan.nodes[i].right));
+
+      // the decoder's values, parents come before their children
+      this->decoded.resize(count);
+
+      if (_plan.root >= 0)
+        this->decoded[_plan.root] = this->lifted[_plan.root];
+
+      for (size_t i = 0; i < count; ++i)
+      {
+        const auto &node = _plan.nodes[i];
+        const FrameDetailData::Code code = FrameDetailData::quantize(this->decoded[i],
+            this->liftedValue(node.left), this->liftedValue(node.right));
+
+        this->codes[i] = code;
+
+        if (node.left >= 0)
+          this->decoded[node.left] = FrameDetailData::childValue(this->decoded[i], code, 0);
+        if (node.right >= 0)
+          this->decoded[node.right] = FrameDetailData::childValue(this->decoded[i], code, 1);
+      }
+    }
+
+    /// Leaves straight from the source, then every node from its children,
+    /// deepest layer first
+    private: template <typename T>
+    void computeValues(const ImageMatrixT<T> &_src, const GeometryPlan &_plan)
+    {
+      this->leaf_values.resize(_plan.leaves.size());
+      this->node_records.resize(_plan.nodes.size());
+
+      for (size_t i = 0; i < _plan.leaves.size(); ++i)
+      {
+        const auto &leaf = _plan.leaves[i];
+
+        this->leaf_values[i] = ((leaf.width == 1) && (leaf.height == 1)) ?
+            static_cast<float>(_src.getFragment(leaf.x, leaf.y)) :
+            _src.getAverageValue(leaf.rect());
+      }
+
+      for (size_t i = _plan.nodes.size(); i-- > 0;)
+      {
+        const auto &node = _plan.nodes[i];
+        this->node_records[i] = {node.path, this->value(node.left), this->value(node.right)};
+      }
+    }
+  };
+};
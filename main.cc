@@ -1,13 +1,165 @@
 #include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <string>
 
 #include "Frame.hh"
+#include "Packetizer.hh"
+#include "WireEncoder.hh"
 
 // #include "lena_gray.hh"
 #include "lena_color.hh"
 
 
+int failures = 0;
+
+void check(const bool _ok, const std::string &_what)
+{
+  std::cout << (_ok ? "ok\t" : "FAILED\t") << _what << std::endl;
+
+  if (!_ok)
+    failures++;
+}
+
+bool sameImage(const BIVCodec::ImageMatrix8 &_a, const BIVCodec::ImageMatrix8 &_b)
+{
+  return (_a.width == _b.width) && (_a.height == _b.height) &&
+         (std::memcmp(_a.row(0), _b.row(0), _a.width*_a.height) == 0);
+}
+
+// a batch with lost frames, cut at a display size, ends up as the frames
+// applied one by one
+void checkBatch(const std::vector<BIVCodec::Frame> &_chain)
+{
+  std::vector<BIVCodec::Frame> lossy;
+  for (size_t i = 0; i < _chain.size(); ++i)
+    if ((i == 0) || (i%5 != 0))
+      lossy.push_back(_chain[i]);
+
+  for (const int size : {16, 64})
+  {
+    BIVCodec::ImageBSP batch(BIVCodec::ColorSpace::Grayscale);
+    BIVCodec::ImageBSP sequential(BIVCodec::ColorSpace::Grayscale);
+
+    batch.setDisplaySize(size, size);
+    sequential.setDisplaySize(size, size);
+
+    batch.applyFrameChain(lossy);
+
+    for (const auto &frame : lossy)
+    {
+      if (frame.isImage())
+        sequential.applyFrameData(frame.image);
+      else if (frame.isDetail())
+        sequential.applyFrameData(frame.detail);
+      else
+        sequential.applyFrameData(frame.sync);
+    }
+
+    batch.repair();
+    sequential.repair();
+
+    check(sameImage(batch.asImageMatrix<uint8_t>(size), sequential.asImageMatrix<uint8_t>(size)),
+          "batch as one by one, display " + std::to_string(size));
+  }
+}
+
+// the records of a chain after the sync, each as one little endian word
+std::vector<uint64_t> chainRecords(const uint8_t *_src, const size_t _size)
+{
+  std::vector<uint64_t> records;
+
+  for (size_t offset = BIVCodec::Frame::wire_size; offset < _size; )
+  {
+    const size_t size = BIVCodec::Frame::recordSize(_src[offset]);
+
+    uint64_t record = 0;
+    for (size_t i = 0; i < size; ++i)
+      record |= static_cast<uint64_t>(_src[offset+i])<<(8*i);
+
+    records.push_back(record);
+    offset += size;
+  }
+
+  return records;
+}
+
+// WireEncoder writes what asFrameChain serializes to, and both packet
+// formats carry it through as the same records, in any order
+void checkWire(BIVCodec::ImageBSP &_bsp, const BIVCodec::ImageMatrix &_src)
+{
+  for (const auto coding : {BIVCodec::FrameCoding::Pair, BIVCodec::FrameCoding::Detail})
+  {
+    const std::string name = (coding == BIVCodec::FrameCoding::Pair) ? "pair" : "detail";
+
+    BIVCodec::WireEncoder encoder(BIVCodec::ImageBSP::max_layers, coding);
+    std::vector<uint8_t> wire(encoder.wireSize(_src.width, _src.height));
+    wire.resize(encoder.encode(_src, &wire[0], wire.size()));
+
+    const auto chain = _bsp.asFrameChain(coding);
+    std::vector<uint8_t> serialized(wire.size());
+    serialized.resize(BIVCodec::Frame::serializeRange(chain, &serialized[0], serialized.size()));
+
+    // the sync's timestamp is the time of encoding
+    const bool same_sync = (serialized.size() >= BIVCodec::Frame::wire_size) &&
+                           std::equal(&wire[0], &wire[6], &serialized[0]);
+    const bool same_records = (wire.size() == serialized.size()) &&
+                              std::equal(wire.begin()+BIVCodec::Frame::wire_size, wire.end(),
+                                         serialized.begin()+BIVCodec::Frame::wire_size);
+
+    check(same_sync && same_records, "wire encoder as frame chain, " + name);
+
+    std::vector<uint64_t> sent = chainRecords(&wire[0], wire.size());
+    std::sort(sent.begin(), sent.end());
+
+    for (const auto format : {BIVCodec::PacketFormat::Runs, BIVCodec::PacketFormat::Entropy})
+    {
+      const std::string what = name + ((format == BIVCodec::PacketFormat::Runs) ? ", runs" : ", entropy");
+
+      BIVCodec::Packetizer packetizer(BIVCodec::Packetizer::default_mtu, format);
+      const size_t count = packetizer.packetize(&wire[0], wire.size());
+
+      std::vector<uint64_t> received;
+      bool synced = (count > 0);
+
+      for (size_t i = 0; i < count; ++i)
+      {
+        std::vector<uint8_t> records(BIVCodec::Packetizer::maxRecordsSize(packetizer.packetData(i), packetizer.packetSize(i)));
+        records.resize(BIVCodec::Packetizer::depacketize(packetizer.packetData(i), packetizer.packetSize(i),
+                                                         &records[0], records.size()));
+
+        synced = synced && (records.size() >= BIVCodec::Frame::wire_size) &&
+                 std::equal(&wire[0], &wire[BIVCodec::Frame::wire_size], &records[0]);
+
+        const std::vector<uint64_t> unpacked = chainRecords(&records[0], records.size());
+        received.insert(received.end(), unpacked.begin(), unpacked.end());
+      }
+
+      std::sort(received.begin(), received.end());
+
+      check(synced && (received == sent), "packets round trip, " + what);
+
+      if ((format != BIVCodec::PacketFormat::Entropy) || (count == 0))
+        continue;
+
+      // a flipped byte in any of the packets' records
+      bool rejected = true;
+
+      for (size_t i = 0; i < count; i += 7)
+      {
+        std::vector<uint8_t> packet(packetizer.packetData(i), packetizer.packetData(i)+packetizer.packetSize(i));
+        packet[BIVCodec::Packetizer::header_size+(packet.size()-BIVCodec::Packetizer::header_size)/2] ^= 0x5a;
+
+        std::vector<uint8_t> records(BIVCodec::Packetizer::maxRecordsSize(&packet[0], packet.size()));
+        rejected = rejected && (BIVCodec::Packetizer::depacketize(&packet[0], packet.size(), &records[0], records.size()) == 0);
+      }
+
+      check(rejected, "damaged packets rejected, " + what);
+    }
+  }
+}
+
 int main(int argc, const char **argv)
 {
   std::vector<uint8_t> source;
@@ -24,6 +176,9 @@ int main(int argc, const char **argv)
 
   std::cout << "Frames: " << bsp_image.frames << std::endl;
 
+  checkBatch(bsp_image.asFrameChain());
+  checkWire(bsp_image, src_image);
+
   BIVCodec::ImageBSP bsp_from_chain(BIVCodec::ColorSpace::Grayscale);
   auto frame_chain = std::move(bsp_image.asFrameChain());
   decltype(frame_chain) new_frame_chain;
@@ -51,4 +206,6 @@ int main(int argc, const char **argv)
     ofs << static_cast<char>(dec_image.getFragment(i));
 
   ofs.close();
+
+  return (failures == 0) ? 0 : 1;
 }
\ No newline at end of file
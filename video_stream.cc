@@ -13,6 +13,10 @@ int main(int argc, const char **argv)
   VideoCapture cap("/home/klokik/Movies/sintel_trailer-480p.mp4");
   assert(cap.isOpened());
 
+  BIVCodec::ThreadPool pool;
+  BIVCodec::ArenaNodeAllocator nodes;
+  Mat dec_mat;
+
   while(1)
   {
     Mat cam_source;
@@ -21,9 +25,11 @@ int main(int argc, const char **argv)
     cvtColor(cam_source, cam_source, CV_BGR2GRAY);
     resize(cam_source, cam_source, Size(64, 64));
 
-    BIVCodec::ImageMatrix mat_source(cam_source.cols, cam_source.rows, BIVCodec::ColorSpace::Grayscale, cam_source.ptr(0));
-    mat_source = std::move(BIVCodec::matrixMap(mat_source, [](auto a) { return a/256; }));
-    BIVCodec::ImageBSP bsp_source(mat_source, BIVCodec::ColorSpace::Grayscale);
+    BIVCodec::ImageMatrix8 mat_source(cam_source.cols, cam_source.rows, BIVCodec::ColorSpace::Grayscale, cam_source.ptr(0));
+    // previous frame's tree is gone by now, reuse its nodes
+    nodes.reset();
+    BIVCodec::ImageBSP bsp_source(mat_source, BIVCodec::ColorSpace::Grayscale,
+        BIVCodec::EncoderMode::Recursive, BIVCodec::ImageBSP::max_layers, &pool, &nodes);
 
     // auto frame_chain = std::move(bsp_source.asFrameChain());
     // BIVCodec::ImageBSP bsp_image(BIVCodec::ColorSpace::Grayscale);
@@ -32,10 +38,10 @@ int main(int argc, const char **argv)
     // bsp_image.applyFrameChain(frame_chain);
     auto &bsp_image = bsp_source;
 
-    BIVCodec::ImageMatrix mat_image = std::move(bsp_image.asImageMatrix(512));
-    // BIVCodec::ImageMatrix mat_image = std::move(mat_source);
+    dec_mat.create(512*mat_source.height/mat_source.width, 512, CV_8UC1);
 
-    Mat dec_mat(mat_image.height, mat_image.width, CV_32F, mat_image.data());
+    BIVCodec::RenderTarget target(dec_mat.ptr(0), dec_mat.cols, dec_mat.rows, dec_mat.step);
+    bsp_image.render(target, &pool);
 
     imshow("BIVCodec", dec_mat);
 
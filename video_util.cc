@@ -8,6 +8,10 @@
 #include <opencv2/opencv.hpp>
 
 #include "Frame.hh"
+#include "FlatImageBSP.hh"
+#include "FrameColumns.hh"
+#include "Packetizer.hh"
+#include "WireEncoder.hh"
 
 using namespace cv;
 
@@ -22,6 +26,14 @@ void encode(const std::vector<std::string> &args)
 
   bool first_frame = true;
 
+  BIVCodec::WireEncoder encoder;
+  // "encode entropy" trades some size for checksummed packets
+  const bool entropy = (args.size() > 1) && (args[1] == "entropy");
+
+  BIVCodec::Packetizer packetizer(BIVCodec::Packetizer::default_mtu,
+      entropy ? BIVCodec::PacketFormat::Entropy : BIVCodec::PacketFormat::Runs);
+  std::vector<uint8_t> buffer;
+
   while (1)
   {
     Mat cap_mat;
@@ -39,19 +51,24 @@ void encode(const std::vector<std::string> &args)
       first_frame = false;
     }
 
-    BIVCodec::ImageMatrix mat_source(cap_mat.cols, cap_mat.rows, BIVCodec::ColorSpace::Grayscale, cap_mat.ptr(0));
-    // mat_source = std::move(BIVCodec::matrixMap(mat_source, [](auto a) { return a/256; }));
-    BIVCodec::ImageBSP bsp_source(mat_source, BIVCodec::ColorSpace::Grayscale);
+    BIVCodec::ImageMatrix8 mat_source(cap_mat.cols, cap_mat.rows, BIVCodec::ColorSpace::Grayscale, cap_mat.ptr(0));
+    buffer.resize(encoder.wireSize(mat_source.width, mat_source.height));
+    size_t size = encoder.encode(mat_source, &buffer[0], buffer.size());
+    assert(size == buffer.size());
 
-    auto frame_chain = std::move(bsp_source.asFrameChain());
+    // datagrams as they'd go over UDP, each behind its size
+    const size_t count = packetizer.packetize(&buffer[0], size);
+    assert(count > 0);
 
-    for (auto frame : frame_chain)
+    for (size_t i = 0; i < count; ++i)
     {
-      auto data = frame.serialize();
-      assert(data.size() == 8);
+      const size_t packet_size = packetizer.packetSize(i);
+      const uint8_t prefix[2] = {static_cast<uint8_t>(packet_size), static_cast<uint8_t>(packet_size>>8)};
 
-      ofs.write(reinterpret_cast<char*>(&data[0]), data.size());
+      ofs.write(reinterpret_cast<const char*>(prefix), 2);
+      ofs.write(reinterpret_cast<const char*>(packetizer.packetData(i)), packet_size);
     }
+
     std::cout << "|" << std::flush;
   }
   std::cout << std::endl;
@@ -64,35 +81,85 @@ void playback(const std::vector<std::string> &args)
   std::ifstream ifs;
   ifs.open("video.bfps", std::ios_base::in|std::ios_base::binary);
 
-  BIVCodec::ImageBSP bsp_image(BIVCodec::ColorSpace::Grayscale);
+  BIVCodec::FlatImageBSP bsp_image(BIVCodec::ColorSpace::Grayscale);
+  BIVCodec::ThreadPool pool;
 
-  char data[8];
+  std::vector<uint8_t> packet(0xffff);
+  std::vector<uint8_t> data;
+  BIVCodec::FrameColumns columns;
 
-  while (!ifs.eof())
-  {
-    BIVCodec::Frame frame;
+  // reallocated only when the stream changes size
+  Mat dec_mat;
+
+  bool stop = false;
 
-    ifs.read(&data[0], 8);
-    frame.deserialize(reinterpret_cast<uint8_t*>(&data[0]));
+  // chain of the packets applied since the last picture was shown
+  BIVCodec::FrameSyncData sync;
+  uint8_t chain = 0;
+  bool pending = false;
 
-    if (frame.header.type == BIVCodec::FrameHeader::HeaderType::Sync)
+  auto show = [&]()
     {
-      auto sync = std::static_pointer_cast<BIVCodec::FrameSyncData>(frame.data);
-      bsp_image.applyFrameData(*sync);
+      const int width = std::min(sync.width*4, 512);
+      dec_mat.create(width*sync.ratio, width, CV_8UC1);
+
+      // nothing finer than the window is worth building
+      bsp_image.setDisplaySize(dec_mat.cols, dec_mat.rows);
 
-      BIVCodec::ImageMatrix mat_image = std::move(bsp_image.asImageMatrix(std::min(sync->width*4, 512)));
-      mat_image = std::move(BIVCodec::matrixMap(mat_image, [](auto a) { return a/256; }));
+      BIVCodec::RenderTarget target(dec_mat.ptr(0), dec_mat.cols, dec_mat.rows, dec_mat.step);
+      bsp_image.renderDirty(target, &pool);
 
-      Mat dec_mat(mat_image.height, mat_image.width, CV_32F, mat_image.data());
       imshow("BIVCodec", dec_mat);
 
       std::cout << "|" << std::flush;
-      if (waitKey(5) == 27)
+      stop = (waitKey(5) == 27);
+      pending = false;
+    };
+
+  while (!stop && ifs)
+  {
+    uint8_t prefix[2];
+    ifs.read(reinterpret_cast<char*>(prefix), 2);
+
+    const size_t packet_size = prefix[0]|(prefix[1]<<8);
+    ifs.read(reinterpret_cast<char*>(&packet[0]), packet_size);
+
+    if (!ifs)
+      break;
+
+    data.resize(BIVCodec::Packetizer::maxRecordsSize(&packet[0], packet_size));
+    const size_t size = BIVCodec::Packetizer::depacketize(&packet[0], packet_size, &data[0], data.size());
+
+    uint8_t packet_chain;
+    size_t index, count;
+    if ((size == 0) || !BIVCodec::Packetizer::packetPosition(&packet[0], packet_size, packet_chain, index, count))
+      continue;
+
+    // the first packet of the next picture shows what made it of the last
+    // one, whichever of its packets got lost
+    if (pending && (packet_chain != chain))
+    {
+      show();
+
+      if (stop)
         break;
     }
-    else
-      bsp_image.applyFrameData(*std::static_pointer_cast<BIVCodec::FrameImageData>(frame.data));
+
+    columns.decode(&data[0], size);
+    bsp_image.applyFrameColumns(columns);
+
+    sync = columns.sync[0];
+    chain = packet_chain;
+    pending = true;
+
+    // no need to wait when the last packet made it
+    if (index+1 == count)
+      show();
   }
+
+  if (pending && !stop)
+    show();
+
   std::cout << std::endl;
 
   ifs.close();